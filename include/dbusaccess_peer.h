@@ -35,6 +35,8 @@
 
 #include "dbusaccess_types.h"
 
+#include <gio/gio.h>
+
 G_BEGIN_DECLS
 
 struct da_peer {
@@ -44,12 +46,93 @@ struct da_peer {
     DACred cred;
 };
 
+#define DA_PEER_STATS_LATENCY_BUCKETS (16)
+
+typedef struct da_peer_stats {
+    guint64 hits;
+    guint64 misses;
+    guint64 lookup_failures;    /* D-Bus query failed */
+    guint64 proc_failures;      /* /proc/pid/status couldn't be read */
+    guint64 expired;            /* Removed by timeout */
+    guint64 vanished;           /* Removed by NameOwnerChanged */
+    guint64 evicted;            /* Removed because the cache was full */
+    guint64 rejected;           /* Failed lookups served from the cache */
+    guint64 refreshes;          /* Stale entries refreshed in background */
+    guint size;                 /* Number of cached peers */
+    guint failed;               /* Number of cached failures */
+    guint aliases;              /* Cached well-known names (in size) */
+
+    /*
+     * Latency of cold lookups. Bucket i counts lookups that took less
+     * than 2^i milliseconds (and at least 2^(i-1) ms), the last bucket
+     * counts everything that didn't fit into the others.
+     */
+    guint64 latency[DA_PEER_STATS_LATENCY_BUCKETS];
+} DAPeerStats;
+
+/*
+ * Unless the bus connection has been set up in advance, the first
+ * synchronous lookup connects to the bus synchronously, which may block
+ * for quite a while. da_peer_bus_init_async connects without blocking,
+ * and so does da_peer_get_async when it finds the bus not connected
+ * yet. Alternatively, an existing connection can be supplied with
+ * da_peer_bus_set_connection (or da_peer_install_filter), which fails
+ * if a different connection is already being used. Either
+ * way, NameOwnerChanged signals are dispatched in the thread-default
+ * context of the caller, the expiration timer runs there too. Once set
+ * up, the bus connection stays in use until the process exits.
+ */
+
+void
+da_peer_bus_init_async(
+    DA_BUS bus,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+gboolean
+da_peer_bus_init_finish(
+    GAsyncResult* result,
+    GError** error);
+
+gboolean
+da_peer_bus_set_connection(
+    DA_BUS bus,
+    GDBusConnection* connection);
+
 /*
  * You don't need to unref the DAPeer returned by da_peer_get. The reference
  * is stored internally by the library for certain period of time. It means
  * however that the object can go away at any time. If you need to keep the
  * pointer to this object, then you need to da_peer_ref and then da_peer_unref
  * it when you no longer need it.
+ *
+ * The peer which leaves the cache (times out, gets evicted, flushed or
+ * loses its name) is only released when the main loop of the bus context
+ * (the thread-default context of whoever has connected the bus) gets to
+ * run. The peers returned by the last da_peer_get or da_peer_get_many
+ * call made by a thread also stay alive until that thread calls either
+ * of them again.
+ *
+ * The cache is thread-safe, da_peer_get and da_peer_get_async can be
+ * called from any thread. Concurrent lookups of the same name share a
+ * single query. The library has no threads of its own. An asynchronous
+ * query is sent from the caller's thread-default context and completes
+ * there. da_peer_get waits for the query that's already in progress only
+ * if another thread is driving it (i.e. runs its context or is blocked
+ * in da_peer_get itself), otherwise it sends one of its own.
+ *
+ * A well-known name is resolved in the same round trip in which the
+ * credentials are queried. The peer which is returned keeps the requested
+ * name but shares the credentials with the owner's one, which gets cached
+ * too. Both count towards max_count (see da_peer_set_cache_limits).
+ * The well-known name is dropped from the cache when it changes owner.
+ *
+ * The bus daemon supplies the uid, the groups and the pid in one reply.
+ * The rest of DACred (the effective gid and the capabilities) is read
+ * from /proc when the peer is handed out for the first time, by whoever
+ * gets it first. The lookups made in advance (by the filter or prefetch)
+ * don't touch /proc at all.
  */
 
 DAPeer*
@@ -57,6 +140,64 @@ da_peer_get(
     DA_BUS bus,
     const char* name);
 
+/*
+ * da_peer_get_async never blocks. It fills the same cache as da_peer_get.
+ * The DAPeer returned by da_peer_get_finish is not referenced either, it
+ * remains valid at least until the callback returns. Concurrent lookups
+ * of the same name share a single query. A cancelled lookup completes
+ * with G_IO_ERROR_CANCELLED without waiting for that query, which keeps
+ * going for the others, and its result still gets cached.
+ */
+
+void
+da_peer_get_async(
+    DA_BUS bus,
+    const char* name,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+DAPeer*
+da_peer_get_finish(
+    GAsyncResult* result,
+    GError** error);
+
+/*
+ * da_peer_get_for_connection does the same thing as da_peer_get for
+ * any connection to the bus daemon of the system or session bus used
+ * by this library (e.g. the one returned by g_bus_get). Connections to
+ * any other message bus get a cache of their own, which lives as long
+ * as the connection and uses the default cache limits. The bus field of
+ * the peers found there has no meaning. For a peer-to-peer connection
+ * (which has no bus daemon and therefore no unique name), the name is
+ * ignored and the peer is looked up by the socket credentials. The
+ * result is cached for the lifetime of the connection. In that case,
+ * the peer's name is NULL and its bus field has no meaning either. The
+ * lifetime rules are the same as for da_peer_get.
+ */
+
+DAPeer*
+da_peer_get_for_connection(
+    GDBusConnection* connection,
+    const char* name);
+
+/*
+ * da_peer_get_many looks up a NULL-terminated list of names. It blocks
+ * like da_peer_get, but all the queries are sent at once, so it takes
+ * roughly one round trip rather than one per name. If peers isn't NULL,
+ * it receives the results (NULL for failed lookups) in the same order,
+ * with the same lifetime rules as for da_peer_get. The names which are
+ * already being looked up by another thread aren't asked about again,
+ * just like with da_peer_get. Returns the number of names successfully
+ * looked up.
+ */
+
+guint
+da_peer_get_many(
+    DA_BUS bus,
+    const char* const* names,
+    DAPeer** peers);
+
 DAPeer*
 da_peer_ref(
     DAPeer* peer);
@@ -65,11 +206,187 @@ void
 da_peer_unref(
     DAPeer* peer);
 
+/*
+ * Same as da_policy_check for the peer's credentials, except that the
+ * results are remembered by the peer, so that repeated checks against
+ * the same policy don't have to walk it again. The remembered results
+ * are dropped when the peer leaves the cache.
+ */
+DA_ACCESS
+da_peer_check(
+    DAPeer* peer,
+    const DAPolicy* policy,
+    guint action,
+    const char* arg,
+    DA_ACCESS def);
+
+/*
+ * da_peer_authorize looks up the sender of the method call without
+ * blocking and checks the policy with da_peer_check. If access is
+ * allowed, func is invoked with the sender's peer (which remains valid
+ * for the duration of the call). Otherwise, the call is completed with
+ * org.freedesktop.DBus.Error.AccessDenied. The same happens if the
+ * sender can't be looked up. Either way, the invocation is consumed,
+ * same as with g_dbus_method_invocation_return_error, i.e. it's the
+ * func's responsibility to complete the call. The destroy notification
+ * is invoked at the end in both cases. The sender is looked up on the
+ * connection which the call has arrived on, the same way as with
+ * da_peer_get_for_connection.
+ */
+
+typedef void (*DAPeerAuthorizeFunc)(
+    GDBusMethodInvocation* invocation,
+    DAPeer* peer,
+    gpointer user_data);
+
+void
+da_peer_authorize(
+    GDBusMethodInvocation* invocation,
+    const DAPolicy* policy,
+    guint action,
+    const char* arg,
+    DA_ACCESS def,
+    DAPeerAuthorizeFunc func,
+    gpointer user_data,
+    GDestroyNotify destroy);
+
+/*
+ * da_peer_install_filter adds a message filter to the connection, which
+ * starts looking up the sender of each incoming method call as soon as
+ * the message arrives, unless the sender is already known. The query is
+ * sent from the GDBus worker thread, before the message gets dispatched
+ * to the handler, so that da_peer_get in the handler usually finds the
+ * peer in the cache or waits for the lookup in progress rather than
+ * starting another one. The connection must be connected to the
+ * specified bus. If the bus is not set up yet, this connection is used
+ * for it.
+ * Returns the filter id to pass to da_peer_remove_filter, zero on
+ * failure.
+ */
+
+guint
+da_peer_install_filter(
+    DA_BUS bus,
+    GDBusConnection* connection);
+
+void
+da_peer_remove_filter(
+    GDBusConnection* connection,
+    guint id);
+
 void
 da_peer_flush(
     DA_BUS bus,
     const char* name);
 
+/*
+ * By default, cached peers expire after 30 seconds of not being used and
+ * the number of cached peers is not limited. Zero timeout_sec disables
+ * expiration, zero max_count removes the size limit. When the cache is
+ * full, the least recently used peer gets evicted.
+ */
+
+void
+da_peer_set_cache_limits(
+    DA_BUS bus,
+    guint timeout_sec,
+    guint max_count);
+
+/*
+ * With prefetch enabled, credentials of the new owner are looked up in
+ * the background whenever NameOwnerChanged reports that a name has been
+ * acquired, so they are already cached by the time the client makes its
+ * first call. For a new connection, name and owner are the same unique
+ * name. The filter is invoked for each such event and returns TRUE if
+ * the owner should be prefetched. NULL filter disables prefetch.
+ * Credentials aren't known at that point, so filtering can only be done
+ * by name.
+ */
+
+typedef gboolean (*DAPeerPrefetchFunc)(
+    DA_BUS bus,
+    const char* name,
+    const char* owner,
+    gpointer user_data);
+
+void
+da_peer_set_prefetch(
+    DA_BUS bus,
+    DAPeerPrefetchFunc filter,
+    gpointer user_data,
+    GDestroyNotify destroy);
+
+/*
+ * With non-zero grace_sec, a peer which has expired is still returned
+ * for up to grace_sec seconds past its timeout, while its credentials
+ * are being refreshed in the background. The entry is replaced when the
+ * refresh completes and removed if the refresh fails. It's removed right
+ * away if the name changes owner. Zero (the default) disables this.
+ */
+
+void
+da_peer_set_stale_timeout(
+    DA_BUS bus,
+    guint grace_sec);
+
+/*
+ * Failed lookups are remembered for 5 seconds by default, up to 1024
+ * names. Until the name changes owner or the entry expires, lookups of
+ * that name fail immediately. Zero timeout_sec disables negative caching,
+ * zero max_count removes the size limit.
+ */
+
+void
+da_peer_set_negative_cache_limits(
+    DA_BUS bus,
+    guint timeout_sec,
+    guint max_count);
+
+/* Takes a snapshot of the cache statistics, FALSE if bus is invalid */
+
+gboolean
+da_peer_stats(
+    DA_BUS bus,
+    DAPeerStats* stats);
+
+/*
+ * Integration with event loops other than GLib's. da_peer_fd returns an
+ * epoll descriptor, which becomes readable when there's something for
+ * da_peer_dispatch to do. da_peer_next_timeout returns the number of
+ * milliseconds until da_peer_dispatch needs to be called anyway (-1 if
+ * there's no such deadline), it should be called every time before
+ * waiting. All three must be called on the same thread, which should
+ * also be the one making the first lookup (or otherwise setting up the
+ * bus connection), and da_peer_fd must be called first. GDBus still does
+ * the actual I/O in its own worker thread. The lookups are driven by
+ * the caller's context, da_peer_fd adds no threads and no handoffs.
+ *
+ * da_peer_fd doesn't change the thread-default context of the calling
+ * thread. The library's context is only used by the library calls made
+ * by that thread, as long as it has no thread-default context of its
+ * own, and only for their duration. The context remains acquired by
+ * that thread until the process exits.
+ *
+ * da_peer_expire removes the expired entries right away, for those who
+ * would rather drive the expiration themselves.
+ */
+
+int
+da_peer_fd(
+    void);
+
+int
+da_peer_next_timeout(
+    void);
+
+void
+da_peer_dispatch(
+    void);
+
+void
+da_peer_expire(
+    DA_BUS bus);
+
 G_END_DECLS
 
 #endif /* DBUSACCESS_PEER_H */
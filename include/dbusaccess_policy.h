@@ -74,6 +74,68 @@ da_policy_new_full(
     const char* spec,
     const DA_ACTION* actions);
 
+/*
+ * da_policy_new_from_fd and da_policy_new_from_file read the spec in
+ * chunks and compile each entry as soon as it has been parsed, without
+ * ever holding the entire spec in memory. That's suitable for large
+ * generated policies. The file descriptor is not closed.
+ */
+DAPolicy*
+da_policy_new_from_fd(
+    int fd,
+    const DA_ACTION* actions);
+
+DAPolicy*
+da_policy_new_from_file(
+    const char* path,
+    const DA_ACTION* actions);
+
+/*
+ * da_policy_new_lazy doesn't parse the spec, it postpones compilation
+ * until the policy is actually needed (by da_policy_check or
+ * da_policy_equal). The spec and the actions are copied. Compilation
+ * happens exactly once and is thread-safe. Since the spec isn't parsed
+ * upfront, syntax errors are only logged at that point and the broken
+ * policy behaves like an empty one, i.e. the default access applies.
+ */
+DAPolicy*
+da_policy_new_lazy(
+    const char* spec,
+    const DA_ACTION* actions);
+
+/*
+ * The following functions derive a new policy from an existing one,
+ * without modifying the original. Entries are addressed by their index,
+ * the new spec fragment may contain one or more entries (the version
+ * prefix is optional). Only the new fragment gets compiled, the rest
+ * of the entries are shared with the original policy. NULL is returned
+ * if the range is invalid or the spec fails to compile.
+ */
+DAPolicy*
+da_policy_insert(
+    const DAPolicy* policy,
+    guint pos,
+    const char* spec,
+    const DA_ACTION* actions);
+
+DAPolicy*
+da_policy_remove(
+    const DAPolicy* policy,
+    guint pos,
+    guint count);
+
+DAPolicy*
+da_policy_replace(
+    const DAPolicy* policy,
+    guint pos,
+    guint count,
+    const char* spec,
+    const DA_ACTION* actions);
+
+guint
+da_policy_count(
+    const DAPolicy* policy);
+
 DAPolicy*
 da_policy_ref(
     DAPolicy* policy);
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2026 Jolla Ltd.
+ * Copyright (C) 2026 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DBUSACCESS_POLICY_HOLDER_H
+#define DBUSACCESS_POLICY_HOLDER_H
+
+#include "dbusaccess_policy.h"
+
+G_BEGIN_DECLS
+
+/*
+ * DAPolicyHolder loads the policy from a file and keeps watching the
+ * file. When the file changes, the new policy is compiled in a worker
+ * thread and then replaced in a single atomic step, unless it's equal
+ * to the current one. If the new policy fails to compile, the last
+ * successfully loaded one remains in effect.
+ *
+ * File change notifications are delivered to the thread-default main
+ * context of the thread which created the holder. The policy itself is
+ * kept in DAPolicySlot, so da_policy_holder_get and da_policy_holder_check
+ * can be called on any thread and never block.
+ *
+ * da_policy_holder_get returns a new reference which has to be released
+ * with da_policy_unref. It may return NULL if the file doesn't exist or
+ * has never been successfully compiled.
+ */
+
+DAPolicyHolder*
+da_policy_holder_new(
+    const char* path,
+    const DA_ACTION* actions);
+
+DAPolicyHolder*
+da_policy_holder_ref(
+    DAPolicyHolder* holder);
+
+void
+da_policy_holder_unref(
+    DAPolicyHolder* holder);
+
+DAPolicy*
+da_policy_holder_get(
+    DAPolicyHolder* holder);
+
+DA_ACCESS
+da_policy_holder_check(
+    DAPolicyHolder* holder,
+    const DACred* cred,
+    guint action,
+    const char* arg,
+    DA_ACCESS def);
+
+G_END_DECLS
+
+#endif /* DBUSACCESS_POLICY_HOLDER_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2026 Jolla Ltd.
+ * Copyright (C) 2026 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DBUSACCESS_POLICY_SLOT_H
+#define DBUSACCESS_POLICY_SLOT_H
+
+#include "dbusaccess_policy.h"
+
+G_BEGIN_DECLS
+
+/*
+ * DAPolicySlot holds the current policy which can be read concurrently
+ * by any number of threads without taking any locks, while another
+ * thread replaces it.
+ *
+ * Readers never block. da_policy_slot_check evaluates the current
+ * policy without even touching its reference count. da_policy_slot_get
+ * returns a new reference which has to be released with da_policy_unref.
+ *
+ * Writers are serialized. da_policy_slot_set publishes the new policy
+ * and then waits until all readers which may have seen the previous one
+ * are done with it (that's normally a matter of microseconds) before
+ * releasing the reference to the previous policy.
+ */
+
+DAPolicySlot*
+da_policy_slot_new(
+    DAPolicy* policy);
+
+DAPolicySlot*
+da_policy_slot_ref(
+    DAPolicySlot* slot);
+
+void
+da_policy_slot_unref(
+    DAPolicySlot* slot);
+
+DAPolicy*
+da_policy_slot_get(
+    DAPolicySlot* slot);
+
+void
+da_policy_slot_set(
+    DAPolicySlot* slot,
+    DAPolicy* policy);
+
+DA_ACCESS
+da_policy_slot_check(
+    DAPolicySlot* slot,
+    const DACred* cred,
+    guint action,
+    const char* arg,
+    DA_ACCESS def);
+
+G_END_DECLS
+
+#endif /* DBUSACCESS_POLICY_SLOT_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -66,6 +66,8 @@ typedef struct da_cred {
 typedef struct da_self DASelf;
 typedef struct da_peer DAPeer;
 typedef struct da_policy /* opaque */ DAPolicy;
+typedef struct da_policy_holder /* opaque */ DAPolicyHolder;
+typedef struct da_policy_slot /* opaque */ DAPolicySlot;
 
 extern GLogModule DBUSACCESS_LOG_MODULE;
 
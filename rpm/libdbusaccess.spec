@@ -8,9 +8,11 @@ URL: https://git.sailfishos.org/mer-core/libdbusaccess
 Source: %{name}-%{version}.tar.bz2
 BuildRequires: pkgconfig(glib-2.0)
 BuildRequires: pkgconfig(gio-2.0)
+BuildRequires: pkgconfig(gio-unix-2.0)
 BuildRequires: pkgconfig(libglibutil)
 BuildRequires: bison
 BuildRequires: flex
+BuildRequires: dbus
 Requires(post): /sbin/ldconfig
 Requires(postun): /sbin/ldconfig
 
@@ -33,12 +33,18 @@
 #include "dbusaccess_parser_p.h"
 #include "dbusaccess_log.h"
 
+#include <errno.h>
+#include <unistd.h>
+
 struct da_parser {
     const DA_ACTION* actions;
     GString* buf;
     GSList* alloc_list;
-    GSList* link_list;
     GSList* entries;
+    DAParserEntryFunc entry_fn;
+    void* entry_data;
+    int fd;
+    gboolean read_error;
 };
 
 void
@@ -50,6 +56,28 @@ da_parser_error(
     GWARN("%s", error);
 }
 
+int
+da_parser_read_input(
+    DAParser* parser,
+    char* buf,
+    int size)
+{
+    if (parser->fd >= 0 && !parser->read_error) {
+        for (;;) {
+            const ssize_t n = read(parser->fd, buf, size);
+            if (n >= 0) {
+                return n;
+            } else if (errno != EINTR) {
+                GWARN("Failed to read policy: %s", strerror(errno));
+                parser->read_error = TRUE;
+                break;
+            }
+        }
+    }
+    /* End of input */
+    return 0;
+}
+
 void
 da_parser_start_string(
     DAParser* parser)
@@ -92,17 +120,6 @@ da_parser_find_action(
     return NULL;
 }
 
-GSList*
-da_parser_new_link(
-    DAParser* parser,
-    void* data)
-{
-    GSList* link = g_slist_append(NULL, NULL);
-    parser->link_list = g_slist_prepend(parser->link_list, link);
-    link->data = data;
-    return link;
-}
-
 char*
 da_parser_new_string(
     DAParser* parser,
@@ -182,11 +199,23 @@ da_parser_new_entry(
 }
 
 void
-da_parser_add_entries(
+da_parser_add_entry(
     DAParser* parser,
-    GSList* entries)
+    DAParserEntry* entry)
 {
-    parser->entries = g_slist_concat(parser->entries, entries);
+    if (parser->entry_fn) {
+        parser->entry_fn(entry, parser->entry_data);
+        /*
+         * Nothing allocated so far is referenced by the parser anymore.
+         * The lookahead token (if any) can only be ';' or the end of
+         * input at this point, neither of which carries any data.
+         */
+        g_slist_free_full(parser->alloc_list, g_free);
+        parser->alloc_list = NULL;
+    } else {
+        /* The list gets reversed by da_parser_compile */
+        parser->entries = g_slist_prepend(parser->entries, entry);
+    }
 }
 
 static
@@ -197,27 +226,44 @@ da_parser_create(
     DAParser* parser = g_slice_new0(DAParser);
     parser->buf = g_string_new(NULL);
     parser->actions = actions;
+    parser->fd = -1;
     return parser;
 }
 
-static
-void
-da_parser_free_link(
-    gpointer data)
-{
-    g_slist_free_1(data);
-}
-
 void
 da_parser_delete(
     DAParser* parser)
 {
-    g_slist_free_full(parser->link_list, da_parser_free_link);
+    g_slist_free(parser->entries);
     g_slist_free_full(parser->alloc_list, g_free);
     g_string_free(parser->buf, TRUE);
     g_slice_free(DAParser, parser);
 }
 
+static
+gboolean
+da_parser_run(
+    DAParser* parser,
+    const char* spec)
+{
+    int result = -1;
+    DAScanner* scanner = da_scanner_create(parser);
+    if (scanner) {
+        DAScannerBuffer* buf = spec ?
+            da_scanner_buffer_create(spec, scanner) :
+            da_scanner_buffer_create_input(scanner);
+        if (buf) {
+#ifdef DEBUG
+            da_parser_debug = gutil_log_default.level >= GLOG_LEVEL_DEBUG;
+#endif
+            result = da_parser_parse(parser, scanner);
+            da_scanner_buffer_delete(buf, scanner);
+        }
+        da_scanner_delete(scanner);
+    }
+    return result == 0 && !parser->read_error;
+}
+
 DAParser*
 da_parser_compile(
     const char* spec,
@@ -225,21 +271,9 @@ da_parser_compile(
 {
     if (spec) {
         DAParser* parser = da_parser_create(actions);
-        DAScanner* scanner = da_scanner_create();
-        int result = -1;
-        if (scanner) {
-            DAScannerBuffer* buf = da_scanner_buffer_create(spec, scanner);
-            if (buf) {
-#ifdef DEBUG
-                da_parser_debug = gutil_log_default.level >= GLOG_LEVEL_DEBUG;
-#endif
-                GDEBUG("Parsing \"%s\"", spec);
-                result = da_parser_parse(parser, scanner);
-                da_scanner_buffer_delete(buf, scanner);
-            }
-            da_scanner_delete(scanner);
-        }
-        if (result == 0) {
+        GDEBUG("Parsing \"%s\"", spec);
+        if (da_parser_run(parser, spec)) {
+            parser->entries = g_slist_reverse(parser->entries);
             return parser;
         }
         da_parser_delete(parser);
@@ -247,6 +281,26 @@ da_parser_compile(
     return NULL;
 }
 
+gboolean
+da_parser_compile_fd(
+    int fd,
+    const DA_ACTION* actions,
+    DAParserEntryFunc fn,
+    void* user_data)
+{
+    gboolean ok = FALSE;
+    if (fd >= 0 && fn) {
+        DAParser* parser = da_parser_create(actions);
+        parser->fd = fd;
+        parser->entry_fn = fn;
+        parser->entry_data = user_data;
+        GDEBUG("Parsing fd %d", fd);
+        ok = da_parser_run(parser, NULL);
+        da_parser_delete(parser);
+    }
+    return ok;
+}
+
 GSList*
 da_parser_get_result(
     DAParser* parser)
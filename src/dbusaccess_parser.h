@@ -69,12 +69,32 @@ typedef struct da_parser_entry {
     DA_ACCESS access;
 } DAParserEntry;
 
+typedef
+void
+(*DAParserEntryFunc)(
+    const DAParserEntry* entry,
+    void* user_data);
+
 DAParser*
 da_parser_compile(
     const char* spec,
     const DA_ACTION* actions)
     G_GNUC_INTERNAL;
 
+/*
+ * da_parser_compile_fd reads the spec from the file descriptor in
+ * chunks and passes each entry to the callback as soon as it has been
+ * parsed. Memory allocated for the entry is released right after the
+ * callback returns, so the callback has to copy whatever it needs.
+ */
+gboolean
+da_parser_compile_fd(
+    int fd,
+    const DA_ACTION* actions,
+    DAParserEntryFunc fn,
+    void* user_data)
+    G_GNUC_INTERNAL;
+
 GSList*
 da_parser_get_result(
     DAParser* parser)
@@ -65,7 +65,7 @@ da_parser_error(
 
 DAScanner*
 da_scanner_create(
-    void)
+    DAParser* parser)
     G_GNUC_INTERNAL;
 
 void
@@ -79,6 +79,11 @@ da_scanner_buffer_create(
     DAScanner* scanner)
     G_GNUC_INTERNAL;
 
+DAScannerBuffer*
+da_scanner_buffer_create_input(
+    DAScanner* scanner)
+    G_GNUC_INTERNAL;
+
 void
 da_scanner_buffer_delete(
     DAScannerBuffer* buffer,
@@ -93,6 +98,13 @@ da_parser_parse(
 
 /* These are for the scanner */
 
+int
+da_parser_read_input(
+    DAParser* parser,
+    char* buf,
+    int size)
+    G_GNUC_INTERNAL;
+
 void
 da_parser_start_string(
     DAParser* parser)
@@ -111,12 +123,6 @@ da_parser_finish_string(
 
 /* And these are for the generated parser */
 
-GSList*
-da_parser_new_link(
-    DAParser* parser,
-    void* data)
-    G_GNUC_INTERNAL;
-
 char*
 da_parser_new_string(
     DAParser* parser,
@@ -153,9 +159,9 @@ da_parser_new_entry(
     G_GNUC_INTERNAL;
 
 void
-da_parser_add_entries(
+da_parser_add_entry(
     DAParser* parser,
-    GSList* entries)
+    DAParserEntry* entry)
     G_GNUC_INTERNAL;
 
 #endif /* DBUSACCESS_PARSER_PRIVATE_H */
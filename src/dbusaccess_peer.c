@@ -31,33 +31,234 @@
  */
 
 #include "dbusaccess_peer.h"
-#include "dbusaccess_cred_p.h"
+#include "dbusaccess_policy_p.h"
+#include "dbusaccess_proc_p.h"
 #include "dbusaccess_log.h"
 
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 
 #include <gutil_macros.h>
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
 /* Log module */
 GLOG_MODULE_DEFINE("dbusaccess");
 
 #define DBUSACCESS_PEER_TIMEOUT_SEC (30)
+#define DBUSACCESS_PEER_NEGATIVE_TIMEOUT_SEC (5)
+#define DBUSACCESS_PEER_NEGATIVE_MAX_COUNT (1024)
 
-typedef struct da_peer_bus {
+/* Max number of remembered policy decisions per peer */
+#define DA_PEER_MEMO_MAX (32)
+
+/* Number of independently locked parts of the cache, must be a power of 2 */
+#define DA_PEER_SHARD_COUNT (16)
+
+/* Peer-to-peer connections keep their DAPeer here */
+#define DA_PEER_CONNECTION_KEY "dbusaccess-peer"
+
+/* Other bus connections keep their DAPeerBus here */
+#define DA_PEER_BUS_KEY "dbusaccess-bus"
+
+#define DBUS_SERVICE "org.freedesktop.DBus"
+#define DBUS_PATH "/org/freedesktop/DBus"
+#define DBUS_INTERFACE DBUS_SERVICE
+
+/*
+ * Each shard is protected by its own mutex. The bus lock protects the
+ * initialization and the sweep timer. If both locks are needed, the bus
+ * lock must be taken first.
+ */
+typedef struct da_peer_shard {
+    struct da_peer_bus* bus;
+    GMutex lock;
+    GCond cond; /* Signalled when a request completes */
     GHashTable* peers;
+    GHashTable* pending;
+    GQueue lru; /* Most recently used first */
+    GHashTable* failed;
+    GQueue failed_lru; /* Most recent failure first */
+    guint aliases; /* Number of cached well-known names */
+    DAPeerStats stats;
+} DAPeerShard;
+
+/* Negative cache entry */
+typedef struct da_peer_negative {
+    DAPeerShard* shard;
+    char* name;
+    gint64 expires;
+    GList link;
+} DAPeerNegative;
+
+/* Shared by reference so that the filter can be called without locks */
+typedef struct da_peer_prefetch {
+    gint ref_count;
+    DAPeerPrefetchFunc filter;
+    gpointer user_data;
+    GDestroyNotify destroy;
+} DAPeerPrefetch;
+
+/*
+ * The system and session buses are static and live forever. Any other
+ * bus connection gets a dynamic one, which is reference counted and
+ * goes away together with the connection.
+ */
+typedef struct da_peer_bus {
+    DA_BUS type;
+    gint ref_count; /* Zero if static */
+    gsize initialized;
+    GMutex lock;
     GDBusConnection* connection;
+    GMainContext* context; /* Timers and signals are dispatched there */
+    guint owner_changed_id;
+    GSource* sweep;
+    DAPeerPrefetch* prefetch;
+    gint timeout_sec;
+    gint stale_sec;
+    gint max_count;
+    gint negative_timeout_sec;
+    gint negative_max_count;
+    gint count; /* Total number of cached peers */
+    gint failed_count; /* Total number of cached failures */
+    gint no_credentials;
+    GMutex graveyard_lock; /* Never held together with any other lock */
+    GSList* graveyard; /* Removed peers, released by the bury source */
+    GSource* bury;
+    DAPeerShard shard[DA_PEER_SHARD_COUNT];
 } DAPeerBus;
 
+/* Credentials supplied by the bus daemon */
+typedef struct da_peer_bus_cred {
+    guint flags;
+
+#define DA_PEER_BUS_CRED_PID    (0x01)
+#define DA_PEER_BUS_CRED_UID    (0x02)
+#define DA_PEER_BUS_CRED_GROUPS (0x04)
+
+    guint pid;
+    uid_t uid;
+    gid_t* groups;
+    guint ngroups;
+    int pidfd;
+} DAPeerBusCred;
+
+/*
+ * The credentials which the bus doesn't supply (the effective gid and
+ * the capabilities) are read from /proc when the peer is handed out for
+ * the first time, see da_peer_load.
+ */
 typedef struct da_peer_priv {
     DAPeer pub;
-    DACredPriv cred;
-    DAPeerBus* bus;
+    struct da_peer_priv* owner; /* Set if the name is a well-known one */
+    DAPeerBusCred bus; /* Groups are only kept if they differ from /proc */
+    gsize loaded;
+    DAProc* proc;
+    DAPeerShard* shard;
     char* name;
     gint ref_count;
-    guint timeout_id;
-    guint name_watch_id;
+    gint64 last_used;
+    GList lru_link;
+    GMutex memo_lock;
+    GHashTable* memo; /* Remembered da_peer_check results */
 } DAPeerPriv;
 
+/* Values of DAPeerPriv::loaded, zero means not yet */
+#define DA_PEER_LOADED (1)
+#define DA_PEER_LOAD_FAILED (2)
+
+/* Policy decision, serves as both the key and the value */
+typedef struct da_peer_decision {
+    guint serial;
+    guint action;
+    char* arg;
+    DA_ACCESS def;
+    DA_ACCESS access;
+} DAPeerDecision;
+
+/* Synchronous lookup of multiple names */
+typedef struct da_peer_batch {
+    GMainContext* context;
+    guint pending;
+} DAPeerBatch;
+
+typedef enum da_peer_failure {
+    DA_PEER_FAILURE_NONE,
+    DA_PEER_FAILURE_DBUS,
+    DA_PEER_FAILURE_PROC
+} DA_PEER_FAILURE;
+
+/*
+ * Lookup in progress, shared by all the callers asking for the same name.
+ * Synchronous requests (NULL context) are driven by the thread which has
+ * started them. The rest complete in the context they have been sent
+ * from, which is the caller's thread-default context. There's no thread
+ * of our own, so before blocking on (or joining) a request started by
+ * someone else, da_peer_request_can_wait checks whether it's going to
+ * complete without our help.
+ */
+typedef struct da_peer_request {
+    gint ref_count;
+    DAPeerBus* bus;
+    DAPeerShard* shard;
+    GMainContext* context;
+    char* name;
+    char* owner; /* Owner of the well-known name */
+    gint calls; /* Number of replies still expected */
+    DAPeerBusCred cred;
+    GSList* tasks;
+    DAPeerBatch* batch;
+    DAPeerPriv* peer;
+    gint64 start;
+    DA_PEER_FAILURE failure;
+    gboolean refresh;
+    gboolean stale;
+    gboolean done;
+} DAPeerRequest;
+
+/*
+ * Asynchronous caller waiting for a request. If the task gets cancelled
+ * before the request completes, it's completed right away by the cancel
+ * source, which runs in the task's context. The request keeps going and
+ * its result still gets cached.
+ */
+typedef struct da_peer_waiter {
+    gint ref_count;
+    DAPeerRequest* req;
+    GTask* task;
+    GSource* cancel;
+    gboolean done; /* Protected by the shard lock */
+} DAPeerWaiter;
+
+/*
+ * Library's own context for applications which don't run a GLib main
+ * loop. It's acquired by the thread which called da_peer_fd and is
+ * iterated by da_peer_dispatch. It's only pushed as the thread-default
+ * context for the duration of the library calls made by that thread.
+ */
+typedef struct da_peer_loop {
+    GMainContext* context;
+    int epfd;
+    GPollFD* fds;   /* Registered with epfd */
+    gint nfds;
+    gint timeout;
+} DAPeerLoop;
+
+static GMutex da_peer_loop_lock;
+static DAPeerLoop da_peer_loop = { NULL, -1, NULL, 0, -1 };
+
+/*
+ * Keeps the peers returned by the last da_peer_get or da_peer_get_many
+ * call alive until the same thread makes the next call.
+ */
+static GPrivate da_peer_last = G_PRIVATE_INIT((GDestroyNotify)
+    g_ptr_array_unref);
+
 static inline DAPeerPriv* da_peer_cast(DAPeer* peer)
     { return G_CAST(peer, DAPeerPriv, pub); }
 
@@ -72,268 +273,2790 @@ da_peer_unref1(
 
 static
 DAPeerBus*
-da_peer_bus(
-    DA_BUS type,
-    gboolean initialize)
-{
-    static DAPeerBus da_bus[2];
-    DAPeerBus* bus;
-    GBusType bus_type;
-    switch (type) {
-    case DA_BUS_SYSTEM:
-        bus = da_bus + 0;
-        bus_type = G_BUS_TYPE_SYSTEM;
-        break;
-    case DA_BUS_SESSION:
-        bus = da_bus + 1;
-        bus_type = G_BUS_TYPE_SESSION;
-        break;
-    default:
-        GERR("Invalid bus type %d", type);
-        return NULL;
-    }
-    if (!bus->connection && initialize) {
-        bus->connection = g_bus_get_sync(bus_type, NULL, NULL);
-    }
-    if (bus->connection) {
-        if (!bus->peers) {
-            bus->peers = g_hash_table_new_full(g_str_hash, g_str_equal,
-                NULL, da_peer_unref1);
-        }
-        return bus;
-    } else {
-        return NULL;
-    }
-}
+da_peer_bus_ref(
+    DAPeerBus* bus);
 
 static
 void
-da_peer_dispose(
-    DAPeerPriv* priv)
+da_peer_bus_unref(
+    gpointer data);
+
+static
+gboolean
+da_peer_bury(
+    gpointer data)
 {
-    if (priv->name_watch_id) {
-        g_bus_unwatch_name(priv->name_watch_id);
-        priv->name_watch_id = 0;
-    }
-    if (priv->timeout_id) {
-        g_source_remove(priv->timeout_id);
-        priv->timeout_id = 0;
-    }
+    DAPeerBus* bus = data;
+    GSList* dead;
+
+    g_mutex_lock(&bus->graveyard_lock);
+    dead = bus->graveyard;
+    bus->graveyard = NULL;
+    g_source_unref(bus->bury);
+    bus->bury = NULL;
+    g_mutex_unlock(&bus->graveyard_lock);
+    g_slist_free_full(dead, da_peer_unref1);
+    return G_SOURCE_REMOVE;
 }
 
+/*
+ * The peers which leave the cache aren't released right away, whoever
+ * has got them from da_peer_get without taking a reference may still be
+ * using them. They live until the bus context gets to run, just like
+ * they used to when the cache was only touched by the main loop.
+ */
 static
 void
-da_peer_cleanup(
-    DAPeerBus* bus)
+da_peer_release(
+    DAPeerPriv* priv)
 {
-    if (g_hash_table_size(bus->peers) == 0) {
-        g_hash_table_unref(bus->peers);
-        bus->peers = NULL;
-        if (bus->connection) {
-            g_object_unref(bus->connection);
-            bus->connection = NULL;
-        }
+    DAPeerBus* bus = priv->shard->bus;
+
+    g_mutex_lock(&bus->graveyard_lock);
+    bus->graveyard = g_slist_prepend(bus->graveyard, priv);
+    if (!bus->bury) {
+        bus->bury = g_idle_source_new();
+        g_source_set_callback(bus->bury, da_peer_bury, da_peer_bus_ref(bus),
+            da_peer_bus_unref);
+        g_source_attach(bus->bury, bus->context);
     }
+    g_mutex_unlock(&bus->graveyard_lock);
 }
 
 static
 void
-da_peer_remove(
+da_peer_memo_clear(
     DAPeerPriv* priv)
 {
-    DAPeerBus* bus = priv->bus;
-    da_peer_dispose(priv);
-    g_hash_table_remove(bus->peers, priv->name);
-    da_peer_cleanup(bus);
+    g_mutex_lock(&priv->memo_lock);
+    if (priv->memo) {
+        g_hash_table_remove_all(priv->memo);
+    }
+    g_mutex_unlock(&priv->memo_lock);
 }
 
 static
-gboolean
-da_peer_timeout(
+void
+da_peer_uncache(
     gpointer data)
 {
     DAPeerPriv* priv = data;
-    GDEBUG("Name '%s' timed out", priv->name);
-    priv->timeout_id = 0;
-    da_peer_remove(priv);
-    return G_SOURCE_REMOVE;
+    g_queue_unlink(&priv->shard->lru, &priv->lru_link);
+    g_atomic_int_add(&priv->shard->bus->count, -1);
+    if (priv->owner) {
+        priv->shard->aliases--;
+    }
+    /* Whoever still holds a reference will have to check again */
+    da_peer_memo_clear(priv);
+    da_peer_release(priv);
 }
 
 static
 void
-da_peer_vanished(
-    GDBusConnection* bus,
-    const char* name,
+da_peer_negative_free(
     gpointer data)
 {
-    GDEBUG("Name '%s' has disappeared", name);
-    da_peer_remove(data);
+    DAPeerNegative* failure = data;
+    g_queue_unlink(&failure->shard->failed_lru, &failure->link);
+    g_atomic_int_add(&failure->shard->bus->failed_count, -1);
+    g_free(failure->name);
+    g_slice_free(DAPeerNegative, failure);
 }
+
 static
 void
-da_peer_reset_timeout(
-    DAPeerPriv* priv)
+da_peer_prefetch_unref(
+    DAPeerPrefetch* prefetch)
 {
-    if (priv->timeout_id) {
-        g_source_remove(priv->timeout_id);
+    if (g_atomic_int_dec_and_test(&prefetch->ref_count)) {
+        if (prefetch->destroy) {
+            prefetch->destroy(prefetch->user_data);
+        }
+        g_slice_free(DAPeerPrefetch, prefetch);
     }
-    priv->timeout_id = g_timeout_add_seconds(DBUSACCESS_PEER_TIMEOUT_SEC,
-        da_peer_timeout, priv);
 }
 
 static
-DAPeerPriv*
-da_peer_new(
+void
+da_peer_name_owner_changed(
+    GDBusConnection* connection,
+    const char* sender,
+    const char* path,
+    const char* iface,
+    const char* signal,
+    GVariant* args,
+    gpointer data);
+
+static
+void
+da_peer_background_start(
     DAPeerBus* bus,
-    const char* name)
+    const char* name,
+    gboolean refresh);
+
+/*
+ * Pushes the da_peer_fd context as thread-default, if it belongs to this
+ * thread and the thread doesn't have a thread-default context of its own.
+ * Returns the context to pass to da_peer_loop_pop. The context is set
+ * once and never goes away, so it's read without locking.
+ */
+static
+GMainContext*
+da_peer_loop_push(
+    void)
 {
-    DAPeerPriv* priv = g_slice_new0(DAPeerPriv);
-    DAPeer* peer = &priv->pub;
-    peer->name = priv->name = g_strdup(name);
-    priv->bus = bus;
-    priv->ref_count = 1;
-    da_peer_reset_timeout(priv);
-    priv->name_watch_id = g_bus_watch_name_on_connection(bus->connection, name,
-        G_BUS_NAME_WATCHER_FLAGS_NONE, NULL, da_peer_vanished, priv, NULL);
-    return priv;
+    if (!g_main_context_get_thread_default()) {
+        GMainContext* context = g_atomic_pointer_get(&da_peer_loop.context);
+        if (context && g_main_context_is_owner(context)) {
+            g_main_context_push_thread_default(context);
+            return context;
+        }
+    }
+    return NULL;
 }
 
 static
 void
-da_peer_finalize(
-    DAPeerPriv* priv)
+da_peer_loop_pop(
+    GMainContext* context)
 {
-    if (priv->name_watch_id) {
-        g_bus_unwatch_name(priv->name_watch_id);
+    if (context) {
+        g_main_context_pop_thread_default(context);
     }
-    if (priv->timeout_id) {
-        g_source_remove(priv->timeout_id);
+}
+
+static
+void
+da_peer_bus_defaults(
+    DAPeerBus* bus,
+    DA_BUS type)
+{
+    guint i;
+    bus->type = type;
+    bus->timeout_sec = DBUSACCESS_PEER_TIMEOUT_SEC;
+    bus->negative_timeout_sec = DBUSACCESS_PEER_NEGATIVE_TIMEOUT_SEC;
+    bus->negative_max_count = DBUSACCESS_PEER_NEGATIVE_MAX_COUNT;
+    for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+        bus->shard[i].bus = bus;
     }
-    da_cred_priv_cleanup(&priv->cred);
-    g_free(priv->name);
 }
 
-DAPeer*
-da_peer_ref(
-    DAPeer* peer)
+static
+DAPeerBus*
+da_peer_bus_slot(
+    DA_BUS type)
 {
-    if (peer) {
-        DAPeerPriv* priv = da_peer_cast(peer);
-        g_atomic_int_inc(&priv->ref_count);
+    static DAPeerBus da_bus[2];
+    DAPeerBus* bus;
+    switch (type) {
+    case DA_BUS_SYSTEM:
+        bus = da_bus + 0;
+        break;
+    case DA_BUS_SESSION:
+        bus = da_bus + 1;
+        break;
+    default:
+        GERR("Invalid bus type %d", type);
+        return NULL;
     }
-    return peer;
+    if (g_once_init_enter(&bus->initialized)) {
+        /* Static mutexes, conditions and queues need no initialization */
+        da_peer_bus_defaults(bus, type);
+        g_once_init_leave(&bus->initialized, TRUE);
+    }
+    return bus;
 }
 
+static inline
+GBusType
+da_peer_bus_type(
+    DA_BUS type)
+{
+    return (type == DA_BUS_SYSTEM) ? G_BUS_TYPE_SYSTEM : G_BUS_TYPE_SESSION;
+}
+
+/*
+ * Bus must be locked. Takes ownership of the connection reference,
+ * unless the bus is a dynamic one (which mustn't keep its connection
+ * alive).
+ */
+static
 void
-da_peer_unref(
-    DAPeer* peer)
+da_peer_bus_setup(
+    DAPeerBus* bus,
+    GDBusConnection* connection)
 {
-    if (peer) {
-        DAPeerPriv* priv = da_peer_cast(peer);
-        if (g_atomic_int_dec_and_test(&priv->ref_count)) {
-            da_peer_finalize(priv);
-            g_slice_free(DAPeerPriv, priv);
-        }
+    GMainContext* loop = da_peer_loop_push();
+    guint i;
+    for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+        DAPeerShard* shard = bus->shard + i;
+        shard->peers = g_hash_table_new_full(g_str_hash,
+            g_str_equal, NULL, da_peer_uncache);
+        shard->pending = g_hash_table_new(g_str_hash,
+            g_str_equal);
+        shard->failed = g_hash_table_new_full(g_str_hash,
+            g_str_equal, NULL, da_peer_negative_free);
     }
+    /* One subscription covers all the cached names */
+    bus->context = g_main_context_ref_thread_default();
+    bus->owner_changed_id = g_dbus_connection_signal_subscribe
+        (connection, DBUS_SERVICE, DBUS_INTERFACE,
+        "NameOwnerChanged", DBUS_PATH, NULL,
+        G_DBUS_SIGNAL_FLAGS_NONE, da_peer_name_owner_changed,
+        da_peer_bus_ref(bus), da_peer_bus_unref);
+    g_atomic_pointer_set(&bus->connection, connection);
+    da_peer_loop_pop(loop);
 }
 
+/*
+ * Returns TRUE if the bus is (now) using this connection. Takes
+ * ownership of the connection reference.
+ */
 static
 gboolean
-da_peer_fill_cred(
-    DAPeerPriv* priv,
-    guint pid)
+da_peer_bus_connect(
+    DAPeerBus* bus,
+    GDBusConnection* connection)
 {
-    char* fname = g_strdup_printf("/proc/%u/status", pid);
-    GError* error = NULL;
-    gchar* data = NULL;
-    gsize len = 0;
     gboolean ok;
-    if (g_file_get_contents(fname, &data, &len, &error)) {
-        GDEBUG("Parsing %s", fname);
-        ok = da_cred_parse(&priv->pub.cred, &priv->cred, data, len);
-        g_free(data);
+    g_mutex_lock(&bus->lock);
+    if (!bus->connection) {
+        da_peer_bus_setup(bus, connection);
+        ok = TRUE;
     } else {
-        GDEBUG("%s: %s", fname, GERRMSG(error));
-        g_error_free(error);
-        ok = FALSE;
+        ok = (bus->connection == connection);
+        g_object_unref(connection);
     }
-    g_free(fname);
+    g_mutex_unlock(&bus->lock);
     return ok;
 }
 
-DAPeer*
-da_peer_get(
+static
+DAPeerBus*
+da_peer_bus(
     DA_BUS type,
+    gboolean initialize)
+{
+    DAPeerBus* bus = da_peer_bus_slot(type);
+    if (!bus) {
+        return NULL;
+    }
+    /* The connection is never dropped once it has been established */
+    if (!g_atomic_pointer_get(&bus->connection) && initialize) {
+        /*
+         * This may block for a while (see da_peer_bus_init_async) but
+         * not under the lock. If another thread gets there first, its
+         * connection is used.
+         */
+        GDBusConnection* connection = g_bus_get_sync
+            (da_peer_bus_type(type), NULL, NULL);
+        if (connection) {
+            da_peer_bus_connect(bus, connection);
+        }
+    }
+    return g_atomic_pointer_get(&bus->connection) ? bus : NULL;
+}
+
+static inline
+DAPeerShard*
+da_peer_shard(
+    DAPeerBus* bus,
     const char* name)
 {
-    if (name) {
-        DAPeerBus* bus = da_peer_bus(type, TRUE);
-        if (bus) {
-            DAPeerPriv* priv = g_hash_table_lookup(bus->peers, name);
-            if (priv) {
-                /* Found cached entry */
-                da_peer_reset_timeout(priv);
-                return &priv->pub;
+    return bus->shard + (g_str_hash(name) & (DA_PEER_SHARD_COUNT - 1));
+}
+
+static
+GPtrArray*
+da_peer_last_reset(
+    void)
+{
+    GPtrArray* last = g_private_get(&da_peer_last);
+    if (last) {
+        g_ptr_array_set_size(last, 0);
+    } else {
+        last = g_ptr_array_new_with_free_func(da_peer_unref1);
+        g_private_set(&da_peer_last, last);
+    }
+    return last;
+}
+
+/* Shard must be locked */
+static
+void
+da_peer_expire_failures(
+    DAPeerShard* shard)
+{
+    const gint64 now = g_get_monotonic_time();
+    /* All failures live equally long, the oldest ones are at the tail */
+    while (shard->failed_lru.tail) {
+        DAPeerNegative* failure = shard->failed_lru.tail->data;
+        if (failure->expires <= now) {
+            g_hash_table_remove(shard->failed, failure->name);
+        } else {
+            break;
+        }
+    }
+}
+
+/* Shard must be locked */
+static
+void
+da_peer_shard_expire(
+    DAPeerBus* bus,
+    DAPeerShard* shard)
+{
+    const guint timeout_sec = g_atomic_int_get(&bus->timeout_sec);
+    if (timeout_sec) {
+        /* Stale entries are kept around for the grace period */
+        const gint64 expired = g_get_monotonic_time() - (timeout_sec +
+            g_atomic_int_get(&bus->stale_sec)) * G_TIME_SPAN_SECOND;
+        /* The least recently used entries are at the tail */
+        while (shard->lru.tail) {
+            DAPeerPriv* priv = shard->lru.tail->data;
+            if (priv->last_used <= expired) {
+                GDEBUG("Name '%s' timed out", priv->name);
+                shard->stats.expired++;
+                g_hash_table_remove(shard->peers, priv->name);
             } else {
-                /* No information about this one */
-                GError* error = NULL;
-                /* This call will block */
-                GVariant* ret = g_dbus_connection_call_sync(bus->connection,
-                    "org.freedesktop.DBus", "/org/freedesktop/DBus",
-                    "org.freedesktop.DBus", "GetConnectionUnixProcessID",
-                    g_variant_new("(s)", name), NULL, G_DBUS_CALL_FLAGS_NONE,
-                    -1, NULL, &error);
-                if (ret) {
-                    guint pid = 0;
-                    DAPeerPriv* priv = da_peer_new(bus, name);
-                    g_variant_get(ret, "(u)", &pid);
-                    g_variant_unref(ret);
-                    /* We've got the pid, read /proc/pid/status */
-                    if (da_peer_fill_cred(priv, pid)) {
-                        /* Cache this info */
-                        priv->pub.pid = pid;
-                        g_hash_table_replace(bus->peers, priv->name, priv);
-                        return &priv->pub;
-                    } else {
-                        da_peer_unref(&priv->pub);
-                    }
-                } else {
-                    GDEBUG("%s", GERRMSG(error));
-                    g_error_free(error);
-                }
-                da_peer_cleanup(bus);
+                break;
             }
         }
     }
-    return NULL;
+    da_peer_expire_failures(shard);
 }
 
+/*
+ * Enforces the size limits. The least recently used peer (or the oldest
+ * failure) of all shards gets evicted. No shard lock may be held by the
+ * caller, since the shards are locked one at a time.
+ */
+static
 void
-da_peer_flush(
-    DA_BUS type,
-    const char* name)
+da_peer_trim(
+    DAPeerBus* bus)
 {
-    DAPeerBus* bus = da_peer_bus(type, FALSE);
-    if (bus) {
-        if (name) {
-            /* Flush information about the specific name */
-            DAPeerPriv* priv = g_hash_table_lookup(bus->peers, name);
-            if (priv) {
-                da_peer_remove(priv);
+    const gint max_count = g_atomic_int_get(&bus->max_count);
+    const gint max_failed = g_atomic_int_get(&bus->negative_max_count);
+    guint i;
+
+    while (max_count && g_atomic_int_get(&bus->count) > max_count) {
+        DAPeerShard* oldest = NULL;
+        gint64 last_used = 0;
+
+        for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+            DAPeerShard* shard = bus->shard + i;
+            g_mutex_lock(&shard->lock);
+            if (shard->lru.tail) {
+                DAPeerPriv* priv = shard->lru.tail->data;
+                if (!oldest || priv->last_used < last_used) {
+                    oldest = shard;
+                    last_used = priv->last_used;
+                }
             }
-        } else {
-            /* Flush everything for this bus */
-            GHashTableIter it;
-            gpointer value;
-            /* Stop all the timers, unwatch the names etc. */
-            g_hash_table_iter_init(&it, bus->peers);
-            while (g_hash_table_iter_next(&it, NULL, &value)) {
-                da_peer_dispose(value);
+            g_mutex_unlock(&shard->lock);
+        }
+        if (!oldest) {
+            break;
+        }
+        g_mutex_lock(&oldest->lock);
+        if (oldest->lru.tail) {
+            DAPeerPriv* priv = oldest->lru.tail->data;
+            GDEBUG("Evicting '%s'", priv->name);
+            oldest->stats.evicted++;
+            g_hash_table_remove(oldest->peers, priv->name);
+        }
+        g_mutex_unlock(&oldest->lock);
+    }
+
+    while (max_failed && g_atomic_int_get(&bus->failed_count) > max_failed) {
+        DAPeerShard* oldest = NULL;
+        gint64 expires = 0;
+
+        /* All failures live equally long */
+        for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+            DAPeerShard* shard = bus->shard + i;
+            g_mutex_lock(&shard->lock);
+            if (shard->failed_lru.tail) {
+                DAPeerNegative* failure = shard->failed_lru.tail->data;
+                if (!oldest || failure->expires < expires) {
+                    oldest = shard;
+                    expires = failure->expires;
+                }
             }
-            g_hash_table_remove_all(bus->peers);
-            da_peer_cleanup(bus);
+            g_mutex_unlock(&shard->lock);
+        }
+        if (!oldest) {
+            break;
+        }
+        g_mutex_lock(&oldest->lock);
+        if (oldest->failed_lru.tail) {
+            DAPeerNegative* failure = oldest->failed_lru.tail->data;
+            g_hash_table_remove(oldest->failed, failure->name);
+        }
+        g_mutex_unlock(&oldest->lock);
+    }
+}
+
+/* Bus must be locked */
+static
+void
+da_peer_stop_sweep(
+    DAPeerBus* bus)
+{
+    if (bus->sweep) {
+        g_source_destroy(bus->sweep);
+        g_source_unref(bus->sweep);
+        bus->sweep = NULL;
+    }
+}
+
+static
+gboolean
+da_peer_sweep(
+    gpointer data)
+{
+    DAPeerBus* bus = data;
+    gboolean keep_going = FALSE;
+    guint i;
+
+    for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+        DAPeerShard* shard = bus->shard + i;
+        g_mutex_lock(&shard->lock);
+        da_peer_shard_expire(bus, shard);
+        g_mutex_unlock(&shard->lock);
+    }
+
+    /* Check whether there's anything left, under both locks */
+    g_mutex_lock(&bus->lock);
+    if (bus->sweep == g_main_current_source()) {
+        for (i = 0; i < DA_PEER_SHARD_COUNT && !keep_going; i++) {
+            DAPeerShard* shard = bus->shard + i;
+            g_mutex_lock(&shard->lock);
+            keep_going = (shard->lru.length || shard->failed_lru.length);
+            g_mutex_unlock(&shard->lock);
+        }
+        if (!keep_going) {
+            g_source_unref(bus->sweep);
+            bus->sweep = NULL;
         }
     }
+    g_mutex_unlock(&bus->lock);
+    return keep_going ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+/* Bus must be locked */
+static
+void
+da_peer_start_sweep_locked(
+    DAPeerBus* bus)
+{
+    const guint timeout_sec = g_atomic_int_get(&bus->timeout_sec);
+    /* Nothing to sweep once the connection of a dynamic bus is gone */
+    if (!bus->sweep && timeout_sec && bus->connection) {
+        /* Entries expire within a third of the timeout after the deadline */
+        bus->sweep = g_timeout_source_new_seconds(MAX(timeout_sec/3, 1));
+        g_source_set_callback(bus->sweep, da_peer_sweep,
+            da_peer_bus_ref(bus), da_peer_bus_unref);
+        g_source_attach(bus->sweep, bus->context);
+    }
+}
+
+static
+void
+da_peer_start_sweep(
+    DAPeerBus* bus)
+{
+    g_mutex_lock(&bus->lock);
+    da_peer_start_sweep_locked(bus);
+    g_mutex_unlock(&bus->lock);
+}
+
+static
+DAPeerBus*
+da_peer_bus_ref(
+    DAPeerBus* bus)
+{
+    if (bus && g_atomic_int_get(&bus->ref_count)) {
+        g_atomic_int_inc(&bus->ref_count);
+    }
+    return bus;
+}
+
+/* Everything that referenced the bus is gone by now */
+static
+void
+da_peer_bus_free(
+    DAPeerBus* bus)
+{
+    guint i;
+    for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+        DAPeerShard* shard = bus->shard + i;
+        g_hash_table_destroy(shard->peers);
+        g_hash_table_destroy(shard->pending);
+        g_hash_table_destroy(shard->failed);
+        g_mutex_clear(&shard->lock);
+        g_cond_clear(&shard->cond);
+    }
+    g_main_context_unref(bus->context);
+    g_mutex_clear(&bus->graveyard_lock);
+    g_mutex_clear(&bus->lock);
+    g_free(bus);
+}
+
+static
+void
+da_peer_bus_unref(
+    gpointer data)
+{
+    DAPeerBus* bus = data;
+    if (bus && g_atomic_int_get(&bus->ref_count) &&
+        g_atomic_int_dec_and_test(&bus->ref_count)) {
+        da_peer_bus_free(bus);
+    }
+}
+
+/* Connection of the dynamic bus is being finalized */
+static
+void
+da_peer_bus_gone(
+    gpointer data,
+    GObject* connection)
+{
+    DAPeerBus* bus = data;
+    guint i;
+
+    GDEBUG("Bus connection %p is gone", connection);
+    g_mutex_lock(&bus->lock);
+    da_peer_stop_sweep(bus);
+    g_dbus_connection_signal_unsubscribe(bus->connection,
+        bus->owner_changed_id);
+    bus->owner_changed_id = 0;
+    g_atomic_pointer_set(&bus->connection, NULL);
+    g_mutex_unlock(&bus->lock);
+    for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+        DAPeerShard* shard = bus->shard + i;
+        GHashTableIter it;
+        gpointer value;
+
+        g_mutex_lock(&shard->lock);
+        g_hash_table_iter_init(&it, shard->pending);
+        while (g_hash_table_iter_next(&it, NULL, &value)) {
+            /* Nothing is going to be cached anymore */
+            ((DAPeerRequest*)value)->stale = TRUE;
+        }
+        g_hash_table_remove_all(shard->peers);
+        g_hash_table_remove_all(shard->failed);
+        g_mutex_unlock(&shard->lock);
+    }
+    /* Cached peers are released in the bus context, they hold a ref too */
+    da_peer_bus_unref(bus);
+}
+
+/*
+ * Returns the bus which the connection is connected to, NULL if it's not
+ * a message bus connection. Another connection to the bus daemon used by
+ * the library for the system or the session bus is as good as that one.
+ * Any other connection gets a bus of its own. The caller must release
+ * the returned reference with da_peer_bus_unref.
+ */
+static
+DAPeerBus*
+da_peer_bus_for_connection(
+    GDBusConnection* connection)
+{
+    static GMutex lock;
+    static const DA_BUS types[] = { DA_BUS_SYSTEM, DA_BUS_SESSION };
+    const char* guid = g_dbus_connection_get_guid(connection);
+    GObject* obj = G_OBJECT(connection);
+    DAPeerBus* bus;
+    guint i;
+
+    if (!g_dbus_connection_get_unique_name(connection)) {
+        return NULL;
+    }
+    for (i = 0; i < G_N_ELEMENTS(types); i++) {
+        bus = da_peer_bus(types[i], FALSE);
+        if (bus && (bus->connection == connection ||
+            !g_strcmp0(g_dbus_connection_get_guid(bus->connection), guid))) {
+            return bus;
+        }
+    }
+    g_mutex_lock(&lock);
+    bus = g_object_get_data(obj, DA_PEER_BUS_KEY);
+    if (bus) {
+        da_peer_bus_ref(bus);
+    } else {
+        GDEBUG("New bus connection %p", connection);
+        bus = g_new0(DAPeerBus, 1);
+        /* This reference is dropped by da_peer_bus_gone */
+        bus->ref_count = 1;
+        da_peer_bus_defaults(bus, DA_BUS_SESSION);
+        g_mutex_init(&bus->lock);
+        g_mutex_init(&bus->graveyard_lock);
+        for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+            g_mutex_init(&bus->shard[i].lock);
+            g_cond_init(&bus->shard[i].cond);
+        }
+        g_mutex_lock(&bus->lock);
+        da_peer_bus_setup(bus, connection);
+        g_mutex_unlock(&bus->lock);
+        g_object_set_data(obj, DA_PEER_BUS_KEY, bus);
+        g_object_weak_ref(obj, da_peer_bus_gone, bus);
+        da_peer_bus_ref(bus);
+    }
+    g_mutex_unlock(&lock);
+    return bus;
+}
+
+/* Shard must be locked */
+static
+void
+da_peer_stats_latency(
+    DAPeerShard* shard,
+    gint64 start)
+{
+    const gint64 ms = (g_get_monotonic_time() - start) / 1000;
+    guint i = 0;
+    /* Bucket i counts lookups that took less than 2^i milliseconds */
+    while (i + 1 < DA_PEER_STATS_LATENCY_BUCKETS && ms >= ((gint64)1 << i)) {
+        i++;
+    }
+    shard->stats.latency[i]++;
+}
+
+static
+void
+da_peer_name_owner_changed(
+    GDBusConnection* connection,
+    const char* sender,
+    const char* path,
+    const char* iface,
+    const char* signal,
+    GVariant* args,
+    gpointer data)
+{
+    DAPeerBus* bus = data;
+    const char* name = NULL;
+    const char* old_owner = NULL;
+    const char* owner = NULL;
+    DAPeerPrefetch* prefetch;
+    DAPeerShard* shard;
+
+    g_variant_get(args, "(&s&s&s)", &name, &old_owner, &owner);
+    shard = da_peer_shard(bus, name);
+    g_mutex_lock(&shard->lock);
+    if (old_owner[0]) {
+        DAPeerRequest* req = g_hash_table_lookup(shard->pending, name);
+        if (g_hash_table_contains(shard->peers, name)) {
+            /* The credentials belonged to the previous owner */
+            GDEBUG("Name '%s' has changed owner", name);
+            shard->stats.vanished++;
+            g_hash_table_remove(shard->peers, name);
+        }
+        if (req) {
+            /* The result may be out of date by the time it arrives */
+            req->stale = TRUE;
+        }
+    }
+    /*
+     * Next lookup may well succeed. Nothing else needs to be done if
+     * the name has just appeared, whatever we know about it is about
+     * the new owner.
+     */
+    g_hash_table_remove(shard->failed, name);
+    g_mutex_unlock(&shard->lock);
+
+    /* The filter may take its time, don't call it under the lock */
+    g_mutex_lock(&bus->lock);
+    prefetch = bus->prefetch;
+    if (prefetch) {
+        g_atomic_int_inc(&prefetch->ref_count);
+    }
+    g_mutex_unlock(&bus->lock);
+    if (prefetch) {
+        if (owner[0] && prefetch->filter(bus->type, name, owner,
+            prefetch->user_data)) {
+            da_peer_background_start(bus, owner, FALSE);
+        }
+        da_peer_prefetch_unref(prefetch);
+    }
+}
+
+/* Shard must be locked */
+static inline
+void
+da_peer_touch(
+    DAPeerPriv* priv)
+{
+    GQueue* lru = &priv->shard->lru;
+    /* Expired entries are removed by da_peer_sweep */
+    priv->last_used = g_get_monotonic_time();
+    if (lru->head != &priv->lru_link) {
+        g_queue_unlink(lru, &priv->lru_link);
+        g_queue_push_head_link(lru, &priv->lru_link);
+    }
+}
+
+/* Shard must be locked */
+static
+gboolean
+da_peer_lookup_failure(
+    DAPeerShard* shard,
+    const char* name)
+{
+    DAPeerNegative* failure = g_hash_table_lookup(shard->failed, name);
+    if (failure) {
+        if (failure->expires > g_get_monotonic_time()) {
+            GDEBUG("Name '%s' is known to fail", name);
+            shard->stats.rejected++;
+            return TRUE;
+        }
+        g_hash_table_remove(shard->failed, name);
+    }
+    return FALSE;
+}
+
+/*
+ * Shard must be locked, returns a new reference or NULL. In the latter
+ * case, failed is set to TRUE if the name is in the negative cache.
+ * The refresh flag is set if a stale entry has been returned and no
+ * refresh is in progress yet.
+ */
+static
+DAPeerPriv*
+da_peer_lookup(
+    DAPeerBus* bus,
+    DAPeerShard* shard,
+    const char* name,
+    gboolean* failed,
+    gboolean* refresh)
+{
+    DAPeerPriv* priv = g_hash_table_lookup(shard->peers, name);
+    *failed = *refresh = FALSE;
+    if (priv) {
+        const guint timeout_sec = g_atomic_int_get(&bus->timeout_sec);
+        shard->stats.hits++;
+        if (timeout_sec && g_atomic_int_get(&bus->stale_sec) &&
+            priv->last_used <= (g_get_monotonic_time() -
+            timeout_sec * G_TIME_SPAN_SECOND) &&
+            !g_hash_table_contains(shard->pending, name)) {
+            shard->stats.refreshes++;
+            *refresh = TRUE;
+        }
+        da_peer_touch(priv);
+        da_peer_ref(&priv->pub);
+    } else if (da_peer_lookup_failure(shard, name)) {
+        *failed = TRUE;
+    } else {
+        shard->stats.misses++;
+    }
+    return priv;
+}
+
+/* Shard must be locked */
+static
+void
+da_peer_cache_failure(
+    DAPeerBus* bus,
+    DAPeerShard* shard,
+    const char* name)
+{
+    const guint timeout_sec = g_atomic_int_get(&bus->negative_timeout_sec);
+    if (timeout_sec) {
+        DAPeerNegative* failure = g_hash_table_lookup(shard->failed, name);
+        if (failure) {
+            g_queue_unlink(&shard->failed_lru, &failure->link);
+        } else {
+            failure = g_slice_new0(DAPeerNegative);
+            failure->shard = shard;
+            failure->name = g_strdup(name);
+            failure->link.data = failure;
+            g_hash_table_insert(shard->failed, failure->name, failure);
+            g_atomic_int_inc(&bus->failed_count);
+        }
+        failure->expires = g_get_monotonic_time() +
+            timeout_sec * G_TIME_SPAN_SECOND;
+        g_queue_push_head_link(&shard->failed_lru, &failure->link);
+        da_peer_expire_failures(shard);
+    }
+}
+
+static
+void
+da_peer_bus_cred_init(
+    DAPeerBusCred* cred)
+{
+    memset(cred, 0, sizeof(*cred));
+    cred->pidfd = -1;
+}
+
+static
+void
+da_peer_bus_cred_cleanup(
+    DAPeerBusCred* cred)
+{
+    g_free(cred->groups);
+    cred->groups = NULL;
+    if (cred->pidfd >= 0) {
+        close(cred->pidfd);
+        cred->pidfd = -1;
+    }
+}
+
+static
+DAPeerPriv*
+da_peer_new(
+    DAPeerBus* bus,
+    const char* name)
+{
+    DAPeerPriv* priv = g_slice_new0(DAPeerPriv);
+    DAPeer* peer = &priv->pub;
+    peer->name = priv->name = g_strdup(name);
+    if (bus) {
+        peer->bus = bus->type;
+        priv->shard = da_peer_shard(da_peer_bus_ref(bus), name);
+    }
+    priv->ref_count = 1;
+    priv->lru_link.data = priv;
+    da_peer_bus_cred_init(&priv->bus);
+    g_mutex_init(&priv->memo_lock);
+    return priv;
+}
+
+/* Shard must be locked. Consumes the reference, returns the cached peer */
+static
+DAPeerPriv*
+da_peer_cache(
+    DAPeerBus* bus,
+    DAPeerPriv* priv,
+    gboolean replace)
+{
+    DAPeerShard* shard = priv->shard;
+    DAPeerPriv* cached = g_hash_table_lookup(shard->peers, priv->name);
+    if (cached && replace) {
+        /* This also unlinks it from the LRU list */
+        g_hash_table_remove(shard->peers, priv->name);
+        cached = NULL;
+    }
+    if (cached) {
+        /* Somebody else got there first */
+        da_peer_unref(&priv->pub);
+        da_peer_touch(cached);
+        return cached;
+    } else {
+        priv->last_used = g_get_monotonic_time();
+        g_queue_push_head_link(&shard->lru, &priv->lru_link);
+        g_hash_table_replace(shard->peers, priv->name, priv);
+        g_atomic_int_inc(&bus->count);
+        if (priv->owner) {
+            shard->aliases++;
+        }
+        return priv;
+    }
+}
+
+static
+void
+da_peer_finalize(
+    DAPeerPriv* priv)
+{
+    da_peer_bus_cred_cleanup(&priv->bus);
+    da_proc_unref(priv->proc);
+    if (priv->owner) {
+        da_peer_unref(&priv->owner->pub);
+    }
+    if (priv->memo) {
+        g_hash_table_destroy(priv->memo);
+    }
+    g_mutex_clear(&priv->memo_lock);
+    g_free(priv->name);
+    if (priv->shard) {
+        da_peer_bus_unref(priv->shard->bus);
+    }
+}
+
+DAPeer*
+da_peer_ref(
+    DAPeer* peer)
+{
+    if (peer) {
+        DAPeerPriv* priv = da_peer_cast(peer);
+        g_atomic_int_inc(&priv->ref_count);
+    }
+    return peer;
+}
+
+void
+da_peer_unref(
+    DAPeer* peer)
+{
+    if (peer) {
+        DAPeerPriv* priv = da_peer_cast(peer);
+        if (g_atomic_int_dec_and_test(&priv->ref_count)) {
+            da_peer_finalize(priv);
+            g_slice_free(DAPeerPriv, priv);
+        }
+    }
+}
+
+static
+gboolean
+da_peer_bus_cred_parse(
+    DAPeerBusCred* cred,
+    GVariant* reply,
+    GUnixFDList* fds)
+{
+    GVariantIter* it = NULL;
+    const char* key;
+    GVariant* value;
+    g_variant_get(reply, "(a{sv})", &it);
+    while (g_variant_iter_next(it, "{&sv}", &key, &value)) {
+        if (!g_strcmp0(key, "ProcessID") &&
+            g_variant_is_of_type(value, G_VARIANT_TYPE_UINT32)) {
+            cred->pid = g_variant_get_uint32(value);
+            cred->flags |= DA_PEER_BUS_CRED_PID;
+        } else if (!g_strcmp0(key, "UnixUserID") &&
+            g_variant_is_of_type(value, G_VARIANT_TYPE_UINT32)) {
+            cred->uid = g_variant_get_uint32(value);
+            cred->flags |= DA_PEER_BUS_CRED_UID;
+        } else if (!g_strcmp0(key, "UnixGroupIDs") &&
+            g_variant_is_of_type(value, G_VARIANT_TYPE("au"))) {
+            gsize i, n = 0;
+            const guint32* gids = g_variant_get_fixed_array(value, &n,
+                sizeof(guint32));
+            g_free(cred->groups);
+            cred->groups = g_new(gid_t, MAX(n, 1));
+            for (i = 0; i < n; i++) {
+                cred->groups[i] = gids[i];
+            }
+            cred->ngroups = n;
+            cred->flags |= DA_PEER_BUS_CRED_GROUPS;
+        } else if (!g_strcmp0(key, "ProcessFD") && fds &&
+            g_variant_is_of_type(value, G_VARIANT_TYPE_HANDLE)) {
+            const gint32 idx = g_variant_get_handle(value);
+            if (cred->pidfd < 0 && idx >= 0 &&
+                idx < g_unix_fd_list_get_length(fds)) {
+                cred->pidfd = g_unix_fd_list_get(fds, idx, NULL);
+            }
+        }
+        g_variant_unref(value);
+    }
+    g_variant_iter_free(it);
+    /* We can't do anything without the pid */
+    return (cred->flags & DA_PEER_BUS_CRED_PID) != 0;
+}
+
+static
+gboolean
+da_peer_same_groups(
+    const DACred* cred,
+    const DAPeerBusCred* bus_cred)
+{
+    return (cred->flags & DBUSACCESS_CRED_GROUPS) &&
+        cred->ngroups == bus_cred->ngroups && (!cred->ngroups ||
+        !memcmp(cred->groups, bus_cred->groups, sizeof(gid_t) *
+        cred->ngroups));
+}
+
+static
+int
+da_peer_pidfd_open(
+    guint pid)
+{
+#ifdef __NR_pidfd_open
+    const int fd = syscall(__NR_pidfd_open, pid, 0);
+    if (fd >= 0) {
+        return fd;
+    }
+    GDEBUG("pidfd_open(%u): %s", pid, strerror(errno));
+#endif
+    return -1;
+}
+
+static
+gboolean
+da_peer_load(
+    DAPeerPriv* priv);
+
+static
+void
+da_peer_load_failed(
+    DAPeerPriv* priv);
+
+static
+gboolean
+da_peer_load_proc(
+    DAPeerPriv* priv)
+{
+    DAPeerBusCred* bus_cred = &priv->bus;
+    DAPeerBus* bus = priv->shard ? priv->shard->bus : NULL;
+    const guint pid = bus_cred->pid;
+    const guint timeout_sec = bus ? g_atomic_int_get(&bus->timeout_sec) : 0;
+    DAProc* proc;
+
+    if (priv->owner) {
+        /* Well-known name shares the owner's credentials */
+        if (da_peer_load(priv->owner)) {
+            priv->pub.cred = priv->owner->pub.cred;
+            return TRUE;
+        }
+        da_peer_load_failed(priv->owner);
+        return FALSE;
+    }
+
+    /*
+     * The bus never tells us the effective gid, so /proc/pid/status
+     * still needs to be parsed, unless another name owned by the same
+     * process has done that recently. The capabilities come from there
+     * too.
+     */
+    proc = da_proc_get(pid, bus_cred->pidfd, timeout_sec ?
+        MIN(timeout_sec, DBUSACCESS_PEER_TIMEOUT_SEC) :
+        DBUSACCESS_PEER_TIMEOUT_SEC);
+    if (proc) {
+        if (bus_cred->pidfd >= 0 && da_proc_exited(bus_cred->pidfd)) {
+            /* The pid may have been reused since the record was read */
+            GDEBUG("Process %u has exited", pid);
+        } else {
+            DACred* cred = &priv->pub.cred;
+
+            priv->proc = proc;
+            *cred = proc->cred;
+            /* Whatever the bus has supplied takes precedence */
+            if (bus_cred->flags & DA_PEER_BUS_CRED_UID) {
+                cred->euid = bus_cred->uid;
+            }
+            if ((bus_cred->flags & DA_PEER_BUS_CRED_GROUPS) &&
+                !da_peer_same_groups(&proc->cred, bus_cred)) {
+                cred->groups = bus_cred->ngroups ? bus_cred->groups : NULL;
+                cred->ngroups = bus_cred->ngroups;
+                cred->flags |= DBUSACCESS_CRED_GROUPS;
+            } else {
+                /* The shared array is just as good */
+                g_free(bus_cred->groups);
+                bus_cred->groups = NULL;
+            }
+            return TRUE;
+        }
+        da_proc_unref(proc);
+    }
+    return FALSE;
+}
+
+/*
+ * Reads /proc once per peer, whichever thread gets there first. The
+ * pidfd isn't needed after that.
+ */
+static
+gboolean
+da_peer_load(
+    DAPeerPriv* priv)
+{
+    if (g_once_init_enter(&priv->loaded)) {
+        const gsize loaded = da_peer_load_proc(priv) ? DA_PEER_LOADED :
+            DA_PEER_LOAD_FAILED;
+        if (priv->bus.pidfd >= 0) {
+            close(priv->bus.pidfd);
+            priv->bus.pidfd = -1;
+        }
+        g_once_init_leave(&priv->loaded, loaded);
+    }
+    return priv->loaded == DA_PEER_LOADED;
+}
+
+/* Makes sure that the peer which couldn't be loaded leaves the cache */
+static
+void
+da_peer_load_failed(
+    DAPeerPriv* priv)
+{
+    DAPeerShard* shard = priv->shard;
+    if (shard) {
+        DAPeerBus* bus = shard->bus;
+        gboolean removed = FALSE;
+
+        g_mutex_lock(&shard->lock);
+        if (g_hash_table_lookup(shard->peers, priv->name) == priv) {
+            shard->stats.proc_failures++;
+            g_hash_table_remove(shard->peers, priv->name);
+            da_peer_cache_failure(bus, shard, priv->name);
+            removed = TRUE;
+        }
+        g_mutex_unlock(&shard->lock);
+        if (removed) {
+            da_peer_trim(bus);
+            da_peer_start_sweep(bus);
+        }
+    }
+}
+
+/* Returns the peer if it can be handed out, otherwise drops the ref */
+static
+DAPeerPriv*
+da_peer_ready(
+    DAPeerPriv* priv)
+{
+    if (priv && !da_peer_load(priv)) {
+        da_peer_load_failed(priv);
+        da_peer_unref(&priv->pub);
+        return NULL;
+    }
+    return priv;
+}
+
+/* Takes over the groups and the pidfd */
+static
+DAPeerPriv*
+da_peer_new_bus_cred(
+    DAPeerBus* bus,
+    const char* name,
+    DAPeerBusCred* bus_cred)
+{
+    DAPeerPriv* priv = da_peer_new(bus, name);
+
+    priv->bus = *bus_cred;
+    priv->pub.pid = bus_cred->pid;
+    da_peer_bus_cred_init(bus_cred);
+    if (priv->bus.pidfd < 0) {
+        priv->bus.pidfd = da_peer_pidfd_open(priv->pub.pid);
+    }
+    if (priv->bus.pidfd < 0) {
+        /*
+         * Without a pidfd there's no telling whether the pid has been
+         * reused by the time /proc gets read, so read it right away.
+         */
+        priv = da_peer_ready(priv);
+    }
+    return priv;
+}
+
+static
+gboolean
+da_peer_no_credentials(
+    DAPeerBus* bus,
+    const GError* error)
+{
+    if (g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+        /* Remember that and don't try again */
+        GDEBUG("GetConnectionCredentials is not supported");
+        g_atomic_int_set(&bus->no_credentials, TRUE);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Context is where the request will be sent from, NULL if synchronous */
+static
+DAPeerRequest*
+da_peer_request_new(
+    DAPeerBus* bus,
+    const char* name,
+    GMainContext* context)
+{
+    DAPeerRequest* req = g_slice_new0(DAPeerRequest);
+    req->ref_count = 1;
+    req->bus = da_peer_bus_ref(bus);
+    req->shard = da_peer_shard(bus, name);
+    req->context = context ? g_main_context_ref(context) : NULL;
+    req->name = g_strdup(name);
+    req->start = g_get_monotonic_time();
+    da_peer_bus_cred_init(&req->cred);
+    return req;
+}
+
+static
+DAPeerRequest*
+da_peer_request_ref(
+    DAPeerRequest* req)
+{
+    g_atomic_int_inc(&req->ref_count);
+    return req;
+}
+
+static
+void
+da_peer_request_unref(
+    DAPeerRequest* req)
+{
+    if (g_atomic_int_dec_and_test(&req->ref_count)) {
+        if (req->peer) {
+            da_peer_unref(&req->peer->pub);
+        }
+        if (req->context) {
+            g_main_context_unref(req->context);
+        }
+        da_peer_bus_cred_cleanup(&req->cred);
+        g_free(req->owner);
+        g_free(req->name);
+        da_peer_bus_unref(req->bus);
+        g_slice_free(DAPeerRequest, req);
+    }
+}
+
+/*
+ * Shard must be locked. Checks whether the request is going to complete
+ * without this thread's help, i.e. whether it's safe to wait for it.
+ */
+static
+gboolean
+da_peer_request_can_wait(
+    DAPeerRequest* req)
+{
+    GMainContext* context = req->context;
+    if (!context) {
+        /* Driven by a thread blocked in a synchronous call */
+        return TRUE;
+    } else if (g_main_context_is_owner(context)) {
+        /* It would have to be dispatched by this very thread */
+        return FALSE;
+    } else if (g_main_context_acquire(context)) {
+        /* Nobody is running it at the moment */
+        g_main_context_release(context);
+        return FALSE;
+    } else {
+        /* Some other thread is */
+        return TRUE;
+    }
+}
+
+/* Shard must be locked. Returns a new reference or NULL */
+static
+DAPeerPriv*
+da_peer_request_wait(
+    DAPeerRequest* req)
+{
+    DAPeerShard* shard = req->shard;
+    DAPeerPriv* priv = NULL;
+    if (!req->done) {
+        GDEBUG("Waiting for %s", req->name);
+        while (!req->done) {
+            g_cond_wait(&shard->cond, &shard->lock);
+        }
+    }
+    if (req->peer) {
+        priv = req->peer;
+        da_peer_ref(&priv->pub);
+    }
+    return priv;
+}
+
+static
+void
+da_peer_task_complete(
+    GTask* task,
+    DAPeerPriv* priv,
+    const char* name)
+{
+    if (priv) {
+        /* The task data keeps the peer alive during the callback */
+        g_task_set_task_data(task, priv, da_peer_unref1);
+        /* Cancellation doesn't stop the result from being cached */
+        if (!g_task_return_error_if_cancelled(task)) {
+            g_task_return_pointer(task, &priv->pub, NULL);
+        }
+    } else if (!g_task_return_error_if_cancelled(task)) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+            "Failed to get credentials of %s", name);
+    }
+    g_object_unref(task);
+}
+
+static
+void
+da_peer_waiter_unref(
+    gpointer data)
+{
+    DAPeerWaiter* waiter = data;
+    if (waiter && g_atomic_int_dec_and_test(&waiter->ref_count)) {
+        if (waiter->cancel) {
+            g_source_unref(waiter->cancel);
+        }
+        g_object_unref(waiter->task);
+        da_peer_request_unref(waiter->req);
+        g_slice_free(DAPeerWaiter, waiter);
+    }
+}
+
+static
+gboolean
+da_peer_waiter_cancelled(
+    GCancellable* cancellable,
+    gpointer data)
+{
+    DAPeerWaiter* waiter = data;
+    DAPeerShard* shard = waiter->req->shard;
+    gboolean cancelled = FALSE;
+
+    g_mutex_lock(&shard->lock);
+    if (!waiter->done) {
+        /* da_peer_request_done will skip it */
+        waiter->done = cancelled = TRUE;
+    }
+    g_mutex_unlock(&shard->lock);
+    if (cancelled) {
+        GDEBUG("Lookup of %s has been cancelled", waiter->req->name);
+        g_task_return_error_if_cancelled(waiter->task);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* Shard must be locked. Consumes the task reference */
+static
+void
+da_peer_waiter_add(
+    DAPeerRequest* req,
+    GTask* task)
+{
+    DAPeerWaiter* waiter = g_slice_new0(DAPeerWaiter);
+    GCancellable* cancellable = g_task_get_cancellable(task);
+
+    waiter->ref_count = 1;
+    waiter->req = da_peer_request_ref(req);
+    waiter->task = task;
+    if (cancellable) {
+        /* The source holds its own reference to the waiter */
+        g_atomic_int_inc(&waiter->ref_count);
+        waiter->cancel = g_cancellable_source_new(cancellable);
+        g_source_set_callback(waiter->cancel, (GSourceFunc)
+            da_peer_waiter_cancelled, waiter, da_peer_waiter_unref);
+        g_source_attach(waiter->cancel, g_task_get_context(task));
+    }
+    req->tasks = g_slist_prepend(req->tasks, waiter);
+}
+
+/*
+ * Caches the owner of a well-known name (unless it's already there).
+ * Consumes the reference, returns a new reference to the cached peer.
+ */
+static
+DAPeerPriv*
+da_peer_cache_owner(
+    DAPeerBus* bus,
+    DAPeerPriv* priv,
+    gboolean refresh)
+{
+    DAPeerShard* shard = priv->shard;
+    g_mutex_lock(&shard->lock);
+    priv = da_peer_cache(bus, priv, refresh);
+    da_peer_ref(&priv->pub);
+    g_mutex_unlock(&shard->lock);
+    return priv;
+}
+
+/* Consumes the reference to the owner */
+static
+DAPeerPriv*
+da_peer_new_alias(
+    DAPeerBus* bus,
+    const char* name,
+    DAPeerPriv* owner)
+{
+    DAPeerPriv* priv = da_peer_new(bus, name);
+    priv->owner = owner;
+    priv->pub.pid = owner->pub.pid;
+    return priv;
+}
+
+/* Consumes the reference to the peer and the request */
+static
+void
+da_peer_request_done(
+    DAPeerRequest* req,
+    DAPeerPriv* priv)
+{
+    DAPeerBus* bus = req->bus;
+    DAPeerShard* shard = req->shard;
+    gboolean cached = FALSE;
+    GSList* waiters;
+    GSList* active = NULL;
+    GSList* l;
+
+    if (priv && req->owner) {
+        gboolean stale;
+
+        /* The owner's entry comes out of the same round trip */
+        g_mutex_lock(&shard->lock);
+        stale = req->stale;
+        g_mutex_unlock(&shard->lock);
+        if (!stale) {
+            priv = da_peer_cache_owner(bus, priv, req->refresh);
+        }
+        priv = da_peer_new_alias(bus, req->name, priv);
+    }
+
+    g_mutex_lock(&shard->lock);
+    da_peer_stats_latency(shard, req->start);
+    switch (req->failure) {
+    case DA_PEER_FAILURE_DBUS:
+        shard->stats.lookup_failures++;
+        break;
+    case DA_PEER_FAILURE_PROC:
+        shard->stats.proc_failures++;
+        break;
+    case DA_PEER_FAILURE_NONE:
+        break;
+    }
+    if (g_hash_table_lookup(shard->pending, req->name) == req) {
+        g_hash_table_remove(shard->pending, req->name);
+    }
+    if (priv) {
+        if (req->stale) {
+            /* The owner has changed, don't cache it */
+            GDEBUG("Not caching '%s'", req->name);
+        } else {
+            priv = da_peer_cache(bus, priv, req->refresh);
+            da_peer_ref(&priv->pub);
+            cached = TRUE;
+        }
+    } else if (!req->stale) {
+        if (req->refresh) {
+            /* Stale entry couldn't be confirmed, stop serving it */
+            g_hash_table_remove(shard->peers, req->name);
+        }
+        /* Don't ask again for a while */
+        da_peer_cache_failure(bus, shard, req->name);
+        cached = TRUE;
+    }
+    req->peer = priv;
+    req->done = TRUE;
+    waiters = g_slist_reverse(req->tasks);
+    req->tasks = NULL;
+    for (l = waiters; l; l = l->next) {
+        DAPeerWaiter* waiter = l->data;
+        /* Skip the ones which have been cancelled */
+        if (!waiter->done) {
+            waiter->done = TRUE;
+            active = g_slist_prepend(active, waiter);
+        }
+    }
+    g_cond_broadcast(&shard->cond);
+    if (req->batch) {
+        req->batch->pending--;
+    }
+    g_mutex_unlock(&shard->lock);
+
+    if (cached) {
+        da_peer_trim(bus);
+        da_peer_start_sweep(bus);
+    }
+
+    /* Everyone who has been waiting gets the same result */
+    for (l = active = g_slist_reverse(active); l; l = l->next) {
+        DAPeerWaiter* waiter = l->data;
+        if (waiter->cancel) {
+            g_source_destroy(waiter->cancel);
+        }
+        if (priv) {
+            da_peer_ref(&priv->pub);
+        }
+        da_peer_task_complete(g_object_ref(waiter->task), priv, req->name);
+    }
+    g_slist_free(active);
+    g_slist_free_full(waiters, da_peer_waiter_unref);
+    da_peer_request_unref(req);
+}
+
+/* Completes the request when the last reply arrives */
+static
+void
+da_peer_request_reply(
+    DAPeerRequest* req)
+{
+    if (g_atomic_int_dec_and_test(&req->calls)) {
+        DAPeerPriv* priv = NULL;
+        if (req->failure == DA_PEER_FAILURE_NONE) {
+            /* A well-known name gets cached by owner too */
+            priv = da_peer_new_bus_cred(req->bus, req->owner ? req->owner :
+                req->name, &req->cred);
+            if (!priv) {
+                req->failure = DA_PEER_FAILURE_PROC;
+            }
+        }
+        da_peer_request_done(req, priv);
+    }
+}
+
+static
+void
+da_peer_request_failed(
+    DAPeerRequest* req,
+    GError* error)
+{
+    if (error) {
+        GDEBUG("%s", GERRMSG(error));
+        g_error_free(error);
+    }
+    req->failure = DA_PEER_FAILURE_DBUS;
+}
+
+/*
+ * The replies have to be dispatched in the request's context. The one
+ * which is being iterated isn't necessarily the thread-default one, in
+ * which case this thread owns it and can push it.
+ */
+static
+gboolean
+da_peer_request_push(
+    DAPeerRequest* req)
+{
+    GMainContext* current = g_main_context_ref_thread_default();
+    const gboolean push = (req->context && req->context != current);
+    g_main_context_unref(current);
+    if (push) {
+        g_main_context_push_thread_default(req->context);
+    }
+    return push;
+}
+
+static
+void
+da_peer_request_pop(
+    DAPeerRequest* req,
+    gboolean pushed)
+{
+    if (pushed) {
+        g_main_context_pop_thread_default(req->context);
+    }
+}
+
+static
+void
+da_peer_get_name_owner_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    DAPeerRequest* req = user_data;
+    GError* error = NULL;
+    GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(object),
+        result, &error);
+
+    if (ret) {
+        const char* owner = NULL;
+        g_variant_get(ret, "(&s)", &owner);
+        if (!req->owner) {
+            req->owner = g_strdup(owner);
+        } else if (strcmp(req->owner, owner)) {
+            DAPeerShard* shard = req->shard;
+
+            /* The credentials may belong to either of them */
+            GDEBUG("Name '%s' has changed owner", req->name);
+            g_mutex_lock(&shard->lock);
+            req->stale = TRUE;
+            g_mutex_unlock(&shard->lock);
+            da_peer_request_failed(req, NULL);
+        }
+        g_variant_unref(ret);
+    } else {
+        da_peer_request_failed(req, error);
+    }
+    da_peer_request_reply(req);
+}
+
+static
+void
+da_peer_get_name_owner(
+    DAPeerRequest* req,
+    GDBusConnection* connection)
+{
+    g_atomic_int_inc(&req->calls);
+    g_dbus_connection_call(connection, DBUS_SERVICE, DBUS_PATH,
+        DBUS_INTERFACE, "GetNameOwner", g_variant_new("(s)", req->name),
+        G_VARIANT_TYPE("(s)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+        da_peer_get_name_owner_done, req);
+}
+
+static
+void
+da_peer_get_pid_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    DAPeerRequest* req = user_data;
+    GError* error = NULL;
+    GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(object),
+        result, &error);
+
+    if (ret) {
+        g_variant_get(ret, "(u)", &req->cred.pid);
+        g_variant_unref(ret);
+        req->cred.flags |= DA_PEER_BUS_CRED_PID;
+    } else {
+        da_peer_request_failed(req, error);
+    }
+    da_peer_request_reply(req);
+}
+
+static
+void
+da_peer_get_pid(
+    DAPeerRequest* req,
+    GDBusConnection* connection)
+{
+    const gboolean pushed = da_peer_request_push(req);
+    g_atomic_int_inc(&req->calls);
+    g_dbus_connection_call(connection, DBUS_SERVICE, DBUS_PATH,
+        DBUS_INTERFACE, "GetConnectionUnixProcessID",
+        g_variant_new("(s)", req->name), G_VARIANT_TYPE("(u)"),
+        G_DBUS_CALL_FLAGS_NONE, -1, NULL, da_peer_get_pid_done, req);
+    da_peer_request_pop(req, pushed);
+}
+
+static
+void
+da_peer_get_credentials_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    DAPeerRequest* req = user_data;
+    GDBusConnection* connection = G_DBUS_CONNECTION(object);
+    GUnixFDList* fds = NULL;
+    GError* error = NULL;
+    GVariant* ret = g_dbus_connection_call_with_unix_fd_list_finish
+        (connection, &fds, result, &error);
+
+    if (ret) {
+        if (!da_peer_bus_cred_parse(&req->cred, ret, fds)) {
+            da_peer_request_failed(req, NULL);
+        }
+        g_variant_unref(ret);
+    } else if (da_peer_no_credentials(req->bus, error)) {
+        /* Fall back to the old method */
+        g_error_free(error);
+        da_peer_get_pid(req, connection);
+    } else {
+        da_peer_request_failed(req, error);
+    }
+    if (fds) {
+        g_object_unref(fds);
+    }
+    da_peer_request_reply(req);
+}
+
+static
+void
+da_peer_get_credentials(
+    DAPeerRequest* req,
+    GDBusConnection* connection)
+{
+    if (g_atomic_int_get(&req->bus->no_credentials)) {
+        da_peer_get_pid(req, connection);
+    } else {
+        g_atomic_int_inc(&req->calls);
+        g_dbus_connection_call_with_unix_fd_list(connection,
+            DBUS_SERVICE, DBUS_PATH, DBUS_INTERFACE,
+            "GetConnectionCredentials", g_variant_new("(s)", req->name),
+            G_VARIANT_TYPE("(a{sv})"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+            NULL, da_peer_get_credentials_done, req);
+    }
+}
+
+/*
+ * Sends the queries. The replies are dispatched in the request's context
+ * and the request completes right there, nothing gets handed over to
+ * another thread. A well-known name is resolved in the same round trip:
+ * the bus daemon handles the calls in order, and if both GetNameOwner
+ * calls return the same owner, the credentials are the owner's ones.
+ */
+static
+void
+da_peer_request_send(
+    DAPeerRequest* req)
+{
+    GDBusConnection* connection = g_atomic_pointer_get(&req->bus->connection);
+    const gboolean pushed = da_peer_request_push(req);
+
+    /* Replies may arrive on another thread while we are still sending */
+    g_atomic_int_inc(&req->calls);
+    if (!connection) {
+        /* Dynamic bus whose connection is gone */
+        da_peer_request_failed(req, NULL);
+    } else if (req->name[0] == ':') {
+        da_peer_get_credentials(req, connection);
+    } else {
+        da_peer_get_name_owner(req, connection);
+        da_peer_get_credentials(req, connection);
+        da_peer_get_name_owner(req, connection);
+    }
+    da_peer_request_pop(req, pushed);
+    da_peer_request_reply(req);
+}
+
+static
+gboolean
+da_peer_request_send_cb(
+    gpointer data)
+{
+    da_peer_request_send(data);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Nobody is waiting for the result of a background lookup, it just
+ * ends up in the cache. A refresh replaces the cached entry, otherwise
+ * names which are already cached are skipped. Returns the new request
+ * (which still needs to be sent from the context) or NULL.
+ */
+static
+DAPeerRequest*
+da_peer_background_new(
+    DAPeerBus* bus,
+    const char* name,
+    gboolean refresh,
+    GMainContext* context)
+{
+    DAPeerShard* shard = da_peer_shard(bus, name);
+    DAPeerRequest* req = NULL;
+
+    g_mutex_lock(&shard->lock);
+    if (!g_hash_table_contains(shard->pending, name) && (refresh ||
+        (!g_hash_table_contains(shard->peers, name) &&
+         !g_hash_table_contains(shard->failed, name)))) {
+        GDEBUG("%s %s", refresh ? "Refreshing" : "Prefetching", name);
+        req = da_peer_request_new(bus, name, context);
+        req->refresh = refresh;
+        g_hash_table_insert(shard->pending, req->name, req);
+    }
+    g_mutex_unlock(&shard->lock);
+    return req;
+}
+
+static
+void
+da_peer_background_start(
+    DAPeerBus* bus,
+    const char* name,
+    gboolean refresh)
+{
+    DAPeerRequest* req = da_peer_background_new(bus, name, refresh,
+        bus->context);
+    if (req) {
+        /*
+         * The caller's context may not be running, or its thread may
+         * block waiting for something else. The bus context is known
+         * to be running, it gets NameOwnerChanged signals.
+         */
+        g_main_context_invoke(bus->context, da_peer_request_send_cb, req);
+    }
+}
+
+/* Consumes the task reference */
+static
+void
+da_peer_get_task(
+    DAPeerBus* bus,
+    const char* name,
+    GTask* task)
+{
+    DAPeerShard* shard = da_peer_shard(bus, name);
+    DAPeerPriv* priv;
+    gboolean failed, refresh;
+
+    g_mutex_lock(&shard->lock);
+    priv = da_peer_lookup(bus, shard, name, &failed, &refresh);
+    if (priv || failed) {
+        /* Found cached entry */
+        g_mutex_unlock(&shard->lock);
+        if (refresh) {
+            da_peer_background_start(bus, name, TRUE);
+        }
+        da_peer_task_complete(task, priv, name);
+    } else {
+        DAPeerRequest* req = g_hash_table_lookup(shard->pending, name);
+        DAPeerRequest* start = NULL;
+        GMainContext* context = g_task_get_context(task);
+        if (req && (req->context == context ||
+            da_peer_request_can_wait(req))) {
+            GDEBUG("Waiting for %s", name);
+        } else {
+            /* Nothing to join (or it may never complete) */
+            start = req = da_peer_request_new(bus, name, context);
+            if (!g_hash_table_contains(shard->pending, name)) {
+                g_hash_table_insert(shard->pending, req->name, req);
+            }
+        }
+        da_peer_waiter_add(req, task);
+        g_mutex_unlock(&shard->lock);
+        if (start) {
+            /* This is the task's context, the reply comes back here */
+            da_peer_request_send(start);
+        }
+    }
+}
+
+static
+void
+da_peer_get_async_connected(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    GTask* task = G_TASK(user_data);
+    GError* error = NULL;
+
+    if (da_peer_bus_init_finish(result, &error)) {
+        /* The queries are sent from the caller's context */
+        GMainContext* context = g_task_get_context(task);
+        char* name = g_strdup(g_task_get_task_data(task));
+        g_main_context_push_thread_default(context);
+        da_peer_get_task(g_task_get_task_data(G_TASK(result)), name, task);
+        g_main_context_pop_thread_default(context);
+        g_free(name);
+    } else {
+        g_task_return_error(task, error);
+        g_object_unref(task);
+    }
+}
+
+void
+da_peer_get_async(
+    DA_BUS type,
+    const char* name,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    GMainContext* loop = da_peer_loop_push();
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    DAPeerBus* bus = da_peer_bus_slot(type);
+    g_task_set_source_tag(task, da_peer_get_async);
+    if (!name) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+            "Missing bus name");
+        g_object_unref(task);
+    } else if (!bus) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+            "Invalid bus type %d", type);
+        g_object_unref(task);
+    } else if (da_peer_bus(type, FALSE)) {
+        da_peer_get_task(bus, name, task);
+    } else {
+        /* Connect without blocking, the lookup continues from there */
+        g_task_set_task_data(task, g_strdup(name), g_free);
+        da_peer_bus_init_async(type, cancellable, da_peer_get_async_connected,
+            task);
+    }
+    da_peer_loop_pop(loop);
+}
+
+DAPeer*
+da_peer_get_finish(
+    GAsyncResult* result,
+    GError** error)
+{
+    DAPeer* peer = g_task_propagate_pointer(G_TASK(result), error);
+    if (peer) {
+        /* The task data keeps the peer alive */
+        DAPeerPriv* priv = da_peer_cast(peer);
+        if (!da_peer_load(priv)) {
+            da_peer_load_failed(priv);
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                "Failed to read credentials of pid %u", (guint)peer->pid);
+            return NULL;
+        }
+    }
+    return peer;
+}
+
+static
+guint
+da_peer_bus_get_many(
+    DAPeerBus* bus,
+    const char* const* names,
+    guint n,
+    DAPeer** peers)
+{
+    guint found = 0;
+    GPtrArray* last = da_peer_last_reset();
+    if (bus && n) {
+        DAPeerPriv** result = g_new0(DAPeerPriv*, n);
+        DAPeerRequest** reqs = g_new0(DAPeerRequest*, n);
+        DAPeerBatch batch;
+        guint i;
+
+        /*
+         * All the queries are sent back-to-back and the replies are
+         * collected by iterating the private context. Nothing else gets
+         * dispatched in the meantime.
+         */
+        batch.context = g_main_context_new();
+        batch.pending = 0;
+        g_main_context_push_thread_default(batch.context);
+        for (i = 0; i < n; i++) {
+            const char* name = names[i];
+            DAPeerShard* shard = da_peer_shard(bus, name);
+            gboolean failed, refresh;
+
+            g_mutex_lock(&shard->lock);
+            result[i] = da_peer_lookup(bus, shard, name, &failed, &refresh);
+            if (!result[i] && !failed) {
+                DAPeerRequest* req = g_hash_table_lookup(shard->pending,
+                    name);
+                if (req && (req->batch == &batch ||
+                    da_peer_request_can_wait(req))) {
+                    /*
+                     * Either the same name is listed more than once, or
+                     * another thread is asking. The latter is waited for
+                     * once our own queries are done.
+                     */
+                    reqs[i] = da_peer_request_ref(req);
+                    g_mutex_unlock(&shard->lock);
+                    continue;
+                }
+                req = da_peer_request_new(bus, name, batch.context);
+                req->batch = &batch;
+                if (!g_hash_table_contains(shard->pending, name)) {
+                    g_hash_table_insert(shard->pending, req->name, req);
+                }
+                reqs[i] = da_peer_request_ref(req);
+                batch.pending++;
+                g_mutex_unlock(&shard->lock);
+                da_peer_request_send(req);
+            } else {
+                g_mutex_unlock(&shard->lock);
+                if (refresh) {
+                    da_peer_background_start(bus, name, TRUE);
+                }
+            }
+        }
+        while (batch.pending) {
+            g_main_context_iteration(batch.context, TRUE);
+        }
+        g_main_context_pop_thread_default(batch.context);
+        g_main_context_unref(batch.context);
+
+        for (i = 0; i < n; i++) {
+            DAPeerRequest* req = reqs[i];
+            if (req) {
+                DAPeerShard* shard = req->shard;
+                g_mutex_lock(&shard->lock);
+                result[i] = da_peer_request_wait(req);
+                g_mutex_unlock(&shard->lock);
+                da_peer_request_unref(req);
+            }
+            result[i] = da_peer_ready(result[i]);
+            if (result[i]) {
+                g_ptr_array_add(last, result[i]);
+                found++;
+            }
+            if (peers) {
+                peers[i] = result[i] ? &result[i]->pub : NULL;
+            }
+        }
+        g_free(reqs);
+        g_free(result);
+    } else if (peers) {
+        memset(peers, 0, sizeof(peers[0]) * n);
+    }
+    return found;
+}
+
+guint
+da_peer_get_many(
+    DA_BUS type,
+    const char* const* names,
+    DAPeer** peers)
+{
+    const guint n = names ? g_strv_length((char**)names) : 0;
+    return da_peer_bus_get_many(n ? da_peer_bus(type, TRUE) : NULL,
+        names, n, peers);
+}
+
+DAPeer*
+da_peer_get(
+    DA_BUS type,
+    const char* name)
+{
+    const char* names[2];
+    DAPeer* peer = NULL;
+
+    names[0] = name;
+    names[1] = NULL;
+    da_peer_get_many(type, names, &peer);
+    return peer;
+}
+
+static
+guint
+da_peer_decision_hash(
+    gconstpointer key)
+{
+    const DAPeerDecision* d = key;
+    return (d->serial * 31 + d->action) * 31 + (d->arg ?
+        g_str_hash(d->arg) : 0) + d->def;
+}
+
+static
+gboolean
+da_peer_decision_equal(
+    gconstpointer a,
+    gconstpointer b)
+{
+    const DAPeerDecision* d1 = a;
+    const DAPeerDecision* d2 = b;
+    return d1->serial == d2->serial && d1->action == d2->action &&
+        d1->def == d2->def && !g_strcmp0(d1->arg, d2->arg);
+}
+
+static
+void
+da_peer_decision_free(
+    gpointer data)
+{
+    DAPeerDecision* d = data;
+    g_free(d->arg);
+    g_slice_free(DAPeerDecision, d);
+}
+
+DA_ACCESS
+da_peer_check(
+    DAPeer* peer,
+    const DAPolicy* policy,
+    guint action,
+    const char* arg,
+    DA_ACCESS def)
+{
+    if (peer && policy && da_peer_load(da_peer_cast(peer))) {
+        DAPeerPriv* priv = da_peer_cast(peer);
+        DAPeerDecision key;
+        DAPeerDecision* d;
+
+        key.serial = da_policy_serial(policy);
+        key.action = action;
+        key.arg = (char*)arg;
+        key.def = def;
+        g_mutex_lock(&priv->memo_lock);
+        d = priv->memo ? g_hash_table_lookup(priv->memo, &key) : NULL;
+        if (d) {
+            key.access = d->access;
+        }
+        g_mutex_unlock(&priv->memo_lock);
+
+        if (!d) {
+            /* The lock isn't held while the policy is being evaluated */
+            key.access = da_policy_check(policy, &peer->cred, action, arg,
+                def);
+            d = g_slice_dup(DAPeerDecision, &key);
+            d->arg = g_strdup(arg);
+            g_mutex_lock(&priv->memo_lock);
+            if (!priv->memo) {
+                priv->memo = g_hash_table_new_full(da_peer_decision_hash,
+                    da_peer_decision_equal, da_peer_decision_free, NULL);
+            } else if (g_hash_table_size(priv->memo) >= DA_PEER_MEMO_MAX) {
+                /* Most peers only ever need a handful of these */
+                g_hash_table_remove_all(priv->memo);
+            }
+            g_hash_table_add(priv->memo, d);
+            g_mutex_unlock(&priv->memo_lock);
+        }
+        return key.access;
+    }
+    return da_policy_check(policy, (peer && da_peer_load(da_peer_cast(peer))) ?
+        &peer->cred : NULL, action, arg, def);
+}
+
+static
+DAPeerPriv*
+da_peer_p2p(
+    GDBusConnection* connection);
+
+typedef struct da_peer_authorize {
+    GDBusMethodInvocation* invocation;
+    DAPolicy* policy;
+    guint action;
+    char* arg;
+    DA_ACCESS def;
+    DAPeerAuthorizeFunc func;
+    gpointer user_data;
+    GDestroyNotify destroy;
+} DAPeerAuthorize;
+
+static
+void
+da_peer_authorize_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    DAPeerAuthorize* auth = user_data;
+    GDBusMethodInvocation* invocation = auth->invocation;
+    GError* error = NULL;
+    DAPeer* peer = da_peer_get_finish(result, &error);
+
+    if (peer && da_peer_check(peer, auth->policy, auth->action, auth->arg,
+        auth->def) == DA_ACCESS_ALLOW) {
+        auth->func(invocation, peer, auth->user_data);
+    } else {
+        if (error) {
+            GDEBUG("%s", GERRMSG(error));
+            g_error_free(error);
+        }
+        GDEBUG("Denying %s.%s to %s",
+            g_dbus_method_invocation_get_interface_name(invocation),
+            g_dbus_method_invocation_get_method_name(invocation),
+            g_dbus_method_invocation_get_sender(invocation));
+        g_dbus_method_invocation_return_error_literal(invocation,
+            G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED, "Access denied");
+    }
+    if (auth->destroy) {
+        auth->destroy(auth->user_data);
+    }
+    da_policy_unref(auth->policy);
+    g_free(auth->arg);
+    g_slice_free(DAPeerAuthorize, auth);
+}
+
+void
+da_peer_authorize(
+    GDBusMethodInvocation* invocation,
+    const DAPolicy* policy,
+    guint action,
+    const char* arg,
+    DA_ACCESS def,
+    DAPeerAuthorizeFunc func,
+    gpointer user_data,
+    GDestroyNotify destroy)
+{
+    GMainContext* loop;
+    GDBusConnection* connection;
+    const char* sender;
+    DAPeerAuthorize* auth;
+    DAPeerBus* bus;
+    GTask* task;
+
+    g_return_if_fail(G_IS_DBUS_METHOD_INVOCATION(invocation));
+    g_return_if_fail(func);
+    loop = da_peer_loop_push();
+    connection = g_dbus_method_invocation_get_connection(invocation);
+    sender = g_dbus_method_invocation_get_sender(invocation);
+    auth = g_slice_new(DAPeerAuthorize);
+    auth->invocation = invocation;
+    auth->policy = da_policy_ref((DAPolicy*)policy);
+    auth->action = action;
+    auth->arg = g_strdup(arg);
+    auth->def = def;
+    auth->func = func;
+    auth->user_data = user_data;
+    auth->destroy = destroy;
+    task = g_task_new(NULL, NULL, da_peer_authorize_done, auth);
+    g_task_set_source_tag(task, da_peer_get_async);
+    if (!g_dbus_connection_get_unique_name(connection)) {
+        /* Socket credentials are available without asking anyone */
+        da_peer_task_complete(task, da_peer_p2p(connection), "peer");
+    } else if (sender) {
+        /* Lookups for the same sender are coalesced */
+        bus = da_peer_bus_for_connection(connection);
+        da_peer_get_task(bus, sender, task);
+        da_peer_bus_unref(bus);
+    } else {
+        GDEBUG("No sender");
+        da_peer_task_complete(task, NULL, "peer");
+    }
+    da_peer_loop_pop(loop);
+}
+
+static
+GDBusMessage*
+da_peer_filter(
+    GDBusConnection* connection,
+    GDBusMessage* message,
+    gboolean incoming,
+    gpointer user_data)
+{
+    /* This runs in the GDBus worker thread and must not block */
+    if (incoming && g_dbus_message_get_message_type(message) ==
+        G_DBUS_MESSAGE_TYPE_METHOD_CALL) {
+        const char* sender = g_dbus_message_get_sender(message);
+        if (sender && sender[0] == ':') {
+            GMainContext* context = g_main_context_ref_thread_default();
+            if (g_main_context_is_owner(context)) {
+                /*
+                 * Send the query before the message gets anywhere near
+                 * its handler. The worker's context is running, so the
+                 * reply gets dispatched and the request completes there.
+                 */
+                DAPeerRequest* req = da_peer_background_new(user_data,
+                    sender, FALSE, context);
+                if (req) {
+                    da_peer_request_send(req);
+                }
+            } else {
+                da_peer_background_start(user_data, sender, FALSE);
+            }
+            g_main_context_unref(context);
+        }
+    }
+    return message;
+}
+
+guint
+da_peer_install_filter(
+    DA_BUS type,
+    GDBusConnection* connection)
+{
+    DAPeerBus* bus = connection ? da_peer_bus_slot(type) : NULL;
+    if (bus && !da_peer_bus(type, FALSE)) {
+        /* Rather than connecting synchronously, use this connection */
+        da_peer_bus_connect(bus, g_object_ref(connection));
+    }
+    return (bus && da_peer_bus(type, FALSE)) ?
+        g_dbus_connection_add_filter(connection, da_peer_filter, bus,
+        NULL) : 0;
+}
+
+void
+da_peer_remove_filter(
+    GDBusConnection* connection,
+    guint id)
+{
+    if (connection && id) {
+        g_dbus_connection_remove_filter(connection, id);
+    }
+}
+
+static
+void
+da_peer_bus_init_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    GTask* task = G_TASK(user_data);
+    DAPeerBus* bus = g_task_get_task_data(task);
+    GError* error = NULL;
+    GDBusConnection* connection = g_bus_get_finish(result, &error);
+    if (connection) {
+        /* The subscription goes to the context of the caller */
+        GMainContext* context = g_task_get_context(task);
+        g_main_context_push_thread_default(context);
+        /* Somebody may have beaten us to it, that's fine too */
+        if (!da_peer_bus_connect(bus, connection)) {
+            GDEBUG("Bus connection is already set up");
+        }
+        g_main_context_pop_thread_default(context);
+        g_task_return_boolean(task, TRUE);
+    } else {
+        g_task_return_error(task, error);
+    }
+    g_object_unref(task);
+}
+
+void
+da_peer_bus_init_async(
+    DA_BUS type,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    GMainContext* loop = da_peer_loop_push();
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    DAPeerBus* bus = da_peer_bus_slot(type);
+    g_task_set_source_tag(task, da_peer_bus_init_async);
+    g_task_set_task_data(task, bus, NULL);
+    if (!bus) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+            "Invalid bus type %d", type);
+        g_object_unref(task);
+    } else if (da_peer_bus(type, FALSE)) {
+        g_task_return_boolean(task, TRUE);
+        g_object_unref(task);
+    } else {
+        g_bus_get(da_peer_bus_type(type), cancellable, da_peer_bus_init_done,
+            task);
+    }
+    da_peer_loop_pop(loop);
+}
+
+gboolean
+da_peer_bus_init_finish(
+    GAsyncResult* result,
+    GError** error)
+{
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+gboolean
+da_peer_bus_set_connection(
+    DA_BUS type,
+    GDBusConnection* connection)
+{
+    DAPeerBus* bus = connection ? da_peer_bus_slot(type) : NULL;
+    return bus && da_peer_bus_connect(bus, g_object_ref(connection));
+}
+
+static
+DAPeerPriv*
+da_peer_new_socket_cred(
+    GDBusConnection* connection)
+{
+    GCredentials* creds = g_dbus_connection_get_peer_credentials(connection);
+    DAPeerPriv* priv = NULL;
+    if (creds) {
+        GError* error = NULL;
+        const pid_t pid = g_credentials_get_unix_pid(creds, &error);
+        if (pid > 0) {
+            DAPeerBusCred cred;
+            da_peer_bus_cred_init(&cred);
+            cred.pid = pid;
+            cred.uid = g_credentials_get_unix_user(creds, NULL);
+            if (cred.uid != (uid_t)-1) {
+                cred.flags |= DA_PEER_BUS_CRED_UID;
+            }
+            /* Loaded right away, there's no cache to keep it in */
+            priv = da_peer_ready(da_peer_new_bus_cred(NULL, NULL, &cred));
+            da_peer_bus_cred_cleanup(&cred);
+        } else {
+            GDEBUG("%s", GERRMSG(error));
+            g_clear_error(&error);
+        }
+    } else {
+        GDEBUG("No peer credentials");
+    }
+    return priv;
+}
+
+/* Returns a new reference or NULL */
+static
+DAPeerPriv*
+da_peer_p2p(
+    GDBusConnection* connection)
+{
+    static GMutex lock;
+    GObject* obj = G_OBJECT(connection);
+    DAPeerPriv* priv;
+    DAPeerPriv* cached;
+
+    g_mutex_lock(&lock);
+    priv = g_object_get_data(obj, DA_PEER_CONNECTION_KEY);
+    if (priv) {
+        da_peer_ref(&priv->pub);
+    }
+    g_mutex_unlock(&lock);
+    if (priv) {
+        return priv;
+    }
+
+    /* Socket credentials never change, /proc is read without the lock */
+    priv = da_peer_new_socket_cred(connection);
+    if (priv) {
+        g_mutex_lock(&lock);
+        cached = g_object_get_data(obj, DA_PEER_CONNECTION_KEY);
+        if (cached) {
+            /* Another thread got here first */
+            da_peer_ref(&cached->pub);
+        } else {
+            g_object_set_data_full(obj, DA_PEER_CONNECTION_KEY, priv,
+                da_peer_unref1);
+            da_peer_ref(&priv->pub);
+        }
+        g_mutex_unlock(&lock);
+        if (cached) {
+            da_peer_unref(&priv->pub);
+            priv = cached;
+        }
+    }
+    return priv;
+}
+
+DAPeer*
+da_peer_get_for_connection(
+    GDBusConnection* connection,
+    const char* name)
+{
+    if (!connection) {
+        da_peer_last_reset();
+    } else if (g_dbus_connection_get_unique_name(connection)) {
+        /* Connected to a message bus, use the cache of that bus */
+        DAPeerBus* bus = da_peer_bus_for_connection(connection);
+        DAPeer* peer = NULL;
+
+        da_peer_bus_get_many(bus, &name, name ? 1 : 0, &peer);
+        da_peer_bus_unref(bus);
+        return peer;
+    } else {
+        /* Peer-to-peer connection, there's only one peer to ask about */
+        GPtrArray* last = da_peer_last_reset();
+        DAPeerPriv* priv = da_peer_p2p(connection);
+
+        if (priv) {
+            g_ptr_array_add(last, priv);
+            return &priv->pub;
+        }
+    }
+    return NULL;
+}
+
+/* Shard must be locked */
+static
+void
+da_peer_flush_name(
+    DAPeerShard* shard,
+    const char* name)
+{
+    DAPeerRequest* req = g_hash_table_lookup(shard->pending, name);
+    if (req) {
+        /* Don't let the lookup in progress put it back */
+        req->stale = TRUE;
+    }
+    g_hash_table_remove(shard->peers, name);
+    g_hash_table_remove(shard->failed, name);
+}
+
+static
+void
+da_peer_flush_stale(
+    gpointer key,
+    gpointer value,
+    gpointer user_data)
+{
+    DAPeerRequest* req = value;
+    req->stale = TRUE;
+}
+
+void
+da_peer_flush(
+    DA_BUS type,
+    const char* name)
+{
+    DAPeerBus* bus = da_peer_bus(type, FALSE);
+    if (bus) {
+        if (name) {
+            /* Flush information about the specific name */
+            DAPeerShard* shard = da_peer_shard(bus, name);
+            DAPeerPriv* priv;
+            char* owner = NULL;
+
+            g_mutex_lock(&shard->lock);
+            priv = g_hash_table_lookup(shard->peers, name);
+            if (priv && priv->owner) {
+                /* The owner's entry goes away too */
+                owner = g_strdup(priv->owner->name);
+            }
+            da_peer_flush_name(shard, name);
+            g_mutex_unlock(&shard->lock);
+
+            if (owner) {
+                shard = da_peer_shard(bus, owner);
+                g_mutex_lock(&shard->lock);
+                da_peer_flush_name(shard, owner);
+                g_mutex_unlock(&shard->lock);
+                g_free(owner);
+            }
+        } else {
+            /* Flush everything for this bus */
+            guint i;
+            for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+                DAPeerShard* shard = bus->shard + i;
+                g_mutex_lock(&shard->lock);
+                g_hash_table_foreach(shard->pending, da_peer_flush_stale,
+                    NULL);
+                g_hash_table_remove_all(shard->peers);
+                g_hash_table_remove_all(shard->failed);
+                g_mutex_unlock(&shard->lock);
+            }
+        }
+    }
+}
+
+void
+da_peer_set_cache_limits(
+    DA_BUS type,
+    guint timeout_sec,
+    guint max_count)
+{
+    DAPeerBus* bus = da_peer_bus_slot(type);
+    if (bus) {
+        g_mutex_lock(&bus->lock);
+        g_atomic_int_set(&bus->max_count, max_count);
+        if (g_atomic_int_get(&bus->timeout_sec) != (gint)timeout_sec) {
+            g_atomic_int_set(&bus->timeout_sec, timeout_sec);
+            /* Restart the sweep with the new period */
+            da_peer_stop_sweep(bus);
+        }
+        if (bus->connection) {
+            gboolean empty = TRUE;
+            guint i;
+            da_peer_trim(bus);
+            for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+                DAPeerShard* shard = bus->shard + i;
+                g_mutex_lock(&shard->lock);
+                da_peer_shard_expire(bus, shard);
+                if (shard->lru.length) {
+                    empty = FALSE;
+                }
+                g_mutex_unlock(&shard->lock);
+            }
+            if (empty) {
+                da_peer_stop_sweep(bus);
+            } else {
+                da_peer_start_sweep_locked(bus);
+            }
+        }
+        g_mutex_unlock(&bus->lock);
+    }
+}
+
+void
+da_peer_set_prefetch(
+    DA_BUS type,
+    DAPeerPrefetchFunc filter,
+    gpointer user_data,
+    GDestroyNotify destroy)
+{
+    /* Takes effect once the bus is connected, no need to connect here */
+    DAPeerBus* bus = da_peer_bus_slot(type);
+    DAPeerPrefetch* prefetch = NULL;
+    DAPeerPrefetch* prev;
+
+    if (bus && filter) {
+        prefetch = g_slice_new(DAPeerPrefetch);
+        prefetch->ref_count = 1;
+        prefetch->filter = filter;
+        prefetch->user_data = user_data;
+        prefetch->destroy = destroy;
+    }
+    if (bus) {
+        g_mutex_lock(&bus->lock);
+        prev = bus->prefetch;
+        bus->prefetch = prefetch;
+        g_mutex_unlock(&bus->lock);
+        if (prev) {
+            da_peer_prefetch_unref(prev);
+        }
+    } else if (destroy) {
+        destroy(user_data);
+    }
+}
+
+void
+da_peer_set_stale_timeout(
+    DA_BUS type,
+    guint grace_sec)
+{
+    DAPeerBus* bus = da_peer_bus_slot(type);
+    if (bus) {
+        g_atomic_int_set(&bus->stale_sec, grace_sec);
+    }
+}
+
+void
+da_peer_set_negative_cache_limits(
+    DA_BUS type,
+    guint timeout_sec,
+    guint max_count)
+{
+    DAPeerBus* bus = da_peer_bus_slot(type);
+    if (bus) {
+        g_atomic_int_set(&bus->negative_timeout_sec, timeout_sec);
+        g_atomic_int_set(&bus->negative_max_count, max_count);
+        if (da_peer_bus(type, FALSE)) {
+            if (!timeout_sec) {
+                guint i;
+                for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+                    DAPeerShard* shard = bus->shard + i;
+                    g_mutex_lock(&shard->lock);
+                    g_hash_table_remove_all(shard->failed);
+                    g_mutex_unlock(&shard->lock);
+                }
+            }
+            da_peer_trim(bus);
+        }
+    }
+}
+
+gboolean
+da_peer_stats(
+    DA_BUS type,
+    DAPeerStats* stats)
+{
+    DAPeerBus* bus = stats ? da_peer_bus_slot(type) : NULL;
+    if (bus) {
+        memset(stats, 0, sizeof(*stats));
+        /* The tables don't exist until the bus is connected */
+        if (da_peer_bus(type, FALSE)) {
+            guint i, k;
+            for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+                DAPeerShard* shard = bus->shard + i;
+                const DAPeerStats* s = &shard->stats;
+                g_mutex_lock(&shard->lock);
+                stats->hits += s->hits;
+                stats->misses += s->misses;
+                stats->lookup_failures += s->lookup_failures;
+                stats->proc_failures += s->proc_failures;
+                stats->expired += s->expired;
+                stats->vanished += s->vanished;
+                stats->evicted += s->evicted;
+                stats->rejected += s->rejected;
+                stats->refreshes += s->refreshes;
+                stats->size += shard->lru.length;
+                stats->failed += shard->failed_lru.length;
+                stats->aliases += shard->aliases;
+                for (k = 0; k < DA_PEER_STATS_LATENCY_BUCKETS; k++) {
+                    stats->latency[k] += s->latency[k];
+                }
+                g_mutex_unlock(&shard->lock);
+            }
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
+
+
+void
+da_peer_expire(
+    DA_BUS type)
+{
+    DAPeerBus* bus = da_peer_bus(type, FALSE);
+    if (bus) {
+        guint i;
+        for (i = 0; i < DA_PEER_SHARD_COUNT; i++) {
+            DAPeerShard* shard = bus->shard + i;
+            g_mutex_lock(&shard->lock);
+            da_peer_shard_expire(bus, shard);
+            g_mutex_unlock(&shard->lock);
+        }
+    }
+}
+
+static
+guint32
+da_peer_loop_events(
+    gushort events)
+{
+    return ((events & G_IO_IN) ? EPOLLIN : 0) |
+        ((events & G_IO_OUT) ? EPOLLOUT : 0) |
+        ((events & G_IO_PRI) ? EPOLLPRI : 0);
+}
+
+/* Loop must be locked */
+static
+void
+da_peer_loop_update(
+    DAPeerLoop* loop)
+{
+    GPollFD* fds = NULL;
+    gint max_priority, n, alloc = 0, i, k;
+
+    /*
+     * Collect the descriptors the context would be polling and the
+     * timeout, and complete the iteration without polling. Whatever
+     * has been found ready gets dispatched by the next da_peer_dispatch.
+     */
+    g_main_context_prepare(loop->context, &max_priority);
+    while ((n = g_main_context_query(loop->context, max_priority,
+        &loop->timeout, fds, alloc)) > alloc) {
+        alloc = n;
+        fds = g_renew(GPollFD, fds, alloc);
+    }
+    g_main_context_check(loop->context, max_priority, fds, n);
+
+    /* The set is usually tiny, rebuild it from scratch */
+    for (i = 0; i < loop->nfds; i++) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->fds[i].fd, NULL);
+    }
+    for (i = 0; i < n; i++) {
+        /* Same descriptor may be polled by more than one source */
+        for (k = 0; k < i && fds[k].fd != fds[i].fd; k++);
+        if (k == i) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.data.fd = fds[i].fd;
+            for (k = i; k < n; k++) {
+                if (fds[k].fd == fds[i].fd) {
+                    ev.events |= da_peer_loop_events(fds[k].events);
+                }
+            }
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fds[i].fd, &ev);
+        }
+    }
+    g_free(loop->fds);
+    loop->fds = fds;
+    loop->nfds = n;
+}
+
+int
+da_peer_fd(
+    void)
+{
+    DAPeerLoop* loop = &da_peer_loop;
+    int fd = -1;
+
+    g_mutex_lock(&da_peer_loop_lock);
+    if (!loop->context) {
+        const int epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd >= 0) {
+            GMainContext* context = g_main_context_new();
+            guint i;
+            loop->epfd = epfd;
+            /*
+             * Keeping the context acquired by this thread makes other
+             * threads wake it up (through the context's own descriptor)
+             * when they add sources to it. The thread-default context is
+             * left alone, the library only pushes this one around its
+             * own calls (see da_peer_loop_push). That way it gets the
+             * NameOwnerChanged signals and the expiration timer, provided
+             * that the bus connection is set up by this thread too.
+             */
+            g_main_context_acquire(context);
+            g_atomic_pointer_set(&loop->context, context);
+            for (i = DA_BUS_SYSTEM; i <= DA_BUS_SESSION; i++) {
+                DAPeerBus* bus = da_peer_bus(i, FALSE);
+                if (bus && bus->context != loop->context) {
+                    GWARN("Bus %u has been set up outside of da_peer_fd "
+                        "thread", i);
+                }
+            }
+        } else {
+            GERR("Failed to create epoll descriptor: %s", strerror(errno));
+        }
+    }
+    if (loop->context) {
+        da_peer_loop_update(loop);
+        fd = loop->epfd;
+    }
+    g_mutex_unlock(&da_peer_loop_lock);
+    return fd;
+}
+
+int
+da_peer_next_timeout(
+    void)
+{
+    DAPeerLoop* loop = &da_peer_loop;
+    int timeout = -1;
+
+    g_mutex_lock(&da_peer_loop_lock);
+    if (loop->context) {
+        /* Timers could have been added since the last dispatch */
+        da_peer_loop_update(loop);
+        timeout = loop->timeout;
+    }
+    g_mutex_unlock(&da_peer_loop_lock);
+    return timeout;
+}
+
+void
+da_peer_dispatch(
+    void)
+{
+    DAPeerLoop* loop = &da_peer_loop;
+    GMainContext* context;
+
+    g_mutex_lock(&da_peer_loop_lock);
+    context = loop->context ? g_main_context_ref(loop->context) : NULL;
+    g_mutex_unlock(&da_peer_loop_lock);
+    if (context) {
+        /* Dispatch everything that's ready, without blocking */
+        while (g_main_context_iteration(context, FALSE));
+        g_mutex_lock(&da_peer_loop_lock);
+        da_peer_loop_update(loop);
+        g_mutex_unlock(&da_peer_loop_lock);
+        g_main_context_unref(context);
+    }
 }
 
 /*
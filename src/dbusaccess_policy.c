@@ -30,12 +30,16 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include "dbusaccess_policy.h"
+#include "dbusaccess_policy_p.h"
 #include "dbusaccess_parser.h"
 #include "dbusaccess_log.h"
 
 #include <gutil_macros.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 typedef struct da_policy_entry DAPolicyEntry;
 typedef struct da_policy_expr DAPolicyExpr;
 
@@ -78,15 +82,25 @@ typedef struct da_policy_expr_identity {
     int gid;
 } DAPolicyExprIdentity;
 
+/*
+ * Compiled entries are immutable and reference counted, so that the
+ * policies derived from each other (see da_policy_splice) can share
+ * them together with their expression trees.
+ */
 struct da_policy_entry {
-    DAPolicyEntry* next;
+    gint ref_count;
     DA_ACCESS access;
     DAPolicyExpr* expr; /* NULL if wildcard */
 };
 
 struct da_policy {
     gint ref_count;
-    DAPolicyEntry* entries;
+    guint serial;       /* Unique for the lifetime of the process */
+    gsize compiled;
+    DAPolicyEntry** entries;
+    guint count;
+    char* spec;         /* Only set until lazy policy gets compiled */
+    DA_ACTION* actions; /* Ditto */
 };
 
 /* Expressions */
@@ -505,45 +519,186 @@ da_policy_expr_new(
 }
 
 static
-void
-da_policy_add_entry(
-    DAPolicy* policy,
+DAPolicyEntry*
+da_policy_entry_new(
     const DAParserEntry* parser_entry)
 {
     DAPolicyEntry* entry = g_slice_new0(DAPolicyEntry);
-    DAPolicyEntry* last = policy->entries;
+    entry->ref_count = 1;
     entry->access = parser_entry->access;
-    entry->expr =  da_policy_expr_new(parser_entry->expr);
-    if (last) {
-        while (last->next) {
-            last = last->next;
-        }
-        last->next = entry;
-    } else {
-        policy->entries = entry;
+    entry->expr = da_policy_expr_new(parser_entry->expr);
+    return entry;
+}
+
+static inline
+DAPolicyEntry*
+da_policy_entry_ref(
+    DAPolicyEntry* entry)
+{
+    g_atomic_int_inc(&entry->ref_count);
+    return entry;
+}
+
+static
+void
+da_policy_entry_unref(
+    gpointer data)
+{
+    DAPolicyEntry* entry = data;
+    if (g_atomic_int_dec_and_test(&entry->ref_count)) {
+        da_policy_expr_free(entry->expr);
+        g_slice_free(DAPolicyEntry, entry);
     }
 }
 
-DAPolicy*
-da_policy_new_full(
+static
+void
+da_policy_build_entry(
+    const DAParserEntry* entry,
+    void* user_data)
+{
+    g_ptr_array_add((GPtrArray*)user_data, da_policy_entry_new(entry));
+}
+
+static
+GPtrArray*
+da_policy_compile_entries(
     const char* spec,
     const DA_ACTION* actions)
 {
-    DAParser* parser = da_parser_compile(spec, actions);
+    DAParser* parser = spec ? da_parser_compile(spec, actions) : NULL;
     if (parser) {
-        DAPolicy* policy = g_slice_new0(DAPolicy);
+        GPtrArray* entries = g_ptr_array_new_with_free_func
+            (da_policy_entry_unref);
         GSList* entry = da_parser_get_result(parser);
         while (entry) {
-            da_policy_add_entry(policy, entry->data);
+            da_policy_build_entry(entry->data, entries);
             entry = entry->next;
         }
-        policy->ref_count = 1;
         da_parser_delete(parser);
-        return policy;
+        return entries;
     }
     return NULL;
 }
 
+static
+void
+da_policy_set_entries(
+    DAPolicy* policy,
+    GPtrArray* entries)
+{
+    /* Takes ownership of the array contents */
+    policy->count = entries->len;
+    g_ptr_array_set_free_func(entries, NULL);
+    policy->entries = (DAPolicyEntry**)g_ptr_array_free(entries, FALSE);
+}
+
+static
+guint
+da_policy_new_serial(
+    void)
+{
+    static gint da_policy_last_serial = 0;
+    /* Zero is never used */
+    return (guint)g_atomic_int_add(&da_policy_last_serial, 1) + 1;
+}
+
+static
+DAPolicy*
+da_policy_alloc(
+    GPtrArray* entries)
+{
+    DAPolicy* policy = g_slice_new0(DAPolicy);
+    policy->ref_count = 1;
+    policy->serial = da_policy_new_serial();
+    policy->compiled = TRUE;
+    da_policy_set_entries(policy, entries);
+    return policy;
+}
+
+guint
+da_policy_serial(
+    const DAPolicy* policy)
+{
+    return policy ? policy->serial : 0;
+}
+
+DA_ACTION*
+da_policy_actions_copy(
+    const DA_ACTION* actions)
+{
+    if (actions) {
+        const DA_ACTION* src = actions;
+        DA_ACTION* copy;
+        DA_ACTION* dest;
+        while (src->name) src++;
+        dest = copy = g_new0(DA_ACTION, src - actions + 1);
+        for (src = actions; src->name; src++, dest++) {
+            dest->name = g_strdup(src->name);
+            dest->id = src->id;
+            dest->args = src->args;
+        }
+        return copy;
+    }
+    return NULL;
+}
+
+void
+da_policy_actions_free(
+    DA_ACTION* actions)
+{
+    if (actions) {
+        DA_ACTION* action = actions;
+        while (action->name) {
+            g_free((char*)action->name);
+            action++;
+        }
+        g_free(actions);
+    }
+}
+
+static
+void
+da_policy_compile_lazy(
+    DAPolicy* policy)
+{
+    GPtrArray* entries = da_policy_compile_entries(policy->spec,
+        policy->actions);
+    if (entries) {
+        da_policy_set_entries(policy, entries);
+    } else {
+        /* Broken policy doesn't match anything */
+        GWARN("Failed to compile policy \"%s\"", policy->spec);
+    }
+    g_free(policy->spec);
+    policy->spec = NULL;
+    da_policy_actions_free(policy->actions);
+    policy->actions = NULL;
+}
+
+static
+DAPolicyEntry* const*
+da_policy_entries(
+    const DAPolicy* policy)
+{
+    DAPolicy* self = (DAPolicy*)policy;
+    /* Lazy policy gets compiled exactly once, by the first caller */
+    if (g_once_init_enter(&self->compiled)) {
+        da_policy_compile_lazy(self);
+        g_once_init_leave(&self->compiled, TRUE);
+    }
+    return self->entries;
+}
+
+DAPolicy*
+da_policy_new_full(
+    const char* spec,
+    const DA_ACTION* actions)
+{
+    GPtrArray* entries = da_policy_compile_entries(spec, actions);
+    return entries ? da_policy_alloc(entries) : NULL;
+}
+
 DAPolicy*
 da_policy_new(
     const char* spec)
@@ -551,19 +706,152 @@ da_policy_new(
     return da_policy_new_full(spec, NULL);
 }
 
+DAPolicy*
+da_policy_new_from_fd(
+    int fd,
+    const DA_ACTION* actions)
+{
+    if (fd >= 0) {
+        GPtrArray* entries = g_ptr_array_new_with_free_func
+            (da_policy_entry_unref);
+        /* Entries are compiled as they get parsed */
+        if (da_parser_compile_fd(fd, actions, da_policy_build_entry,
+            entries)) {
+            return da_policy_alloc(entries);
+        }
+        g_ptr_array_free(entries, TRUE);
+    }
+    return NULL;
+}
+
+DAPolicy*
+da_policy_new_from_file(
+    const char* path,
+    const DA_ACTION* actions)
+{
+    if (path) {
+        int fd;
+        while ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 && errno == EINTR);
+        if (fd >= 0) {
+            DAPolicy* policy = da_policy_new_from_fd(fd, actions);
+            close(fd);
+            return policy;
+        } else {
+            GWARN("%s: %s", path, strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+DAPolicy*
+da_policy_new_lazy(
+    const char* spec,
+    const DA_ACTION* actions)
+{
+    if (spec) {
+        DAPolicy* policy = g_slice_new0(DAPolicy);
+        policy->ref_count = 1;
+        policy->serial = da_policy_new_serial();
+        policy->spec = g_strdup(spec);
+        policy->actions = da_policy_actions_copy(actions);
+        return policy;
+    }
+    return NULL;
+}
+
+static
+DAPolicy*
+da_policy_splice(
+    const DAPolicy* policy,
+    guint pos,
+    guint remove,
+    const char* spec,
+    const DA_ACTION* actions)
+{
+    if (policy) {
+        DAPolicyEntry* const* entries = da_policy_entries(policy);
+        const guint count = policy->count;
+        if (pos <= count && remove <= count - pos) {
+            GPtrArray* added = NULL;
+            if (!spec || (added = da_policy_compile_entries(spec, actions))) {
+                const guint n = added ? added->len : 0;
+                GPtrArray* result = g_ptr_array_new_full(count - remove + n,
+                    da_policy_entry_unref);
+                guint i;
+
+                /* Unchanged entries are shared with the original policy */
+                for (i = 0; i < pos; i++) {
+                    g_ptr_array_add(result, da_policy_entry_ref(entries[i]));
+                }
+                for (i = 0; i < n; i++) {
+                    g_ptr_array_add(result, da_policy_entry_ref
+                        (added->pdata[i]));
+                }
+                for (i = pos + remove; i < count; i++) {
+                    g_ptr_array_add(result, da_policy_entry_ref(entries[i]));
+                }
+                if (added) {
+                    g_ptr_array_free(added, TRUE);
+                }
+                return da_policy_alloc(result);
+            }
+        } else {
+            GWARN("Invalid policy range %u+%u (%u entries)", pos, remove,
+                count);
+        }
+    }
+    return NULL;
+}
+
+DAPolicy*
+da_policy_insert(
+    const DAPolicy* policy,
+    guint pos,
+    const char* spec,
+    const DA_ACTION* actions)
+{
+    return spec ? da_policy_splice(policy, pos, 0, spec, actions) : NULL;
+}
+
+DAPolicy*
+da_policy_remove(
+    const DAPolicy* policy,
+    guint pos,
+    guint count)
+{
+    return da_policy_splice(policy, pos, count, NULL, NULL);
+}
+
+DAPolicy*
+da_policy_replace(
+    const DAPolicy* policy,
+    guint pos,
+    guint count,
+    const char* spec,
+    const DA_ACTION* actions)
+{
+    return spec ? da_policy_splice(policy, pos, count, spec, actions) : NULL;
+}
+
+guint
+da_policy_count(
+    const DAPolicy* policy)
+{
+    return policy ? (da_policy_entries(policy), policy->count) : 0;
+}
+
 static
 void
 da_policy_finalize(
     DAPolicy* policy)
 {
-    if (policy->entries) {
-        DAPolicyEntry* entry = policy->entries;
-        while (entry) {
-            da_policy_expr_free(entry->expr);
-            entry = entry->next;
-        }
-        g_slice_free_chain(DAPolicyEntry, policy->entries, next);
+    guint i;
+    for (i = 0; i < policy->count; i++) {
+        da_policy_entry_unref(policy->entries[i]);
     }
+    g_free(policy->entries);
+    da_policy_actions_free(policy->actions);
+    g_free(policy->spec);
 }
 
 DAPolicy*
@@ -598,17 +886,20 @@ da_policy_equal(
     } else if (!p1 || !p2) {
         return FALSE;
     } else {
-        DAPolicyEntry* e1 = p1->entries;
-        DAPolicyEntry* e2 = p2->entries;
-        while (e1 && e2) {
-            if (!da_policy_expr_equal(e1->expr, e2->expr) ||
-                e1->access != e2->access) {
+        DAPolicyEntry* const* e1 = da_policy_entries(p1);
+        DAPolicyEntry* const* e2 = da_policy_entries(p2);
+        guint i;
+        if (p1->count != p2->count) {
+            return FALSE;
+        }
+        for (i = 0; i < p1->count; i++) {
+            /* Shared entries are equal by definition */
+            if (e1[i] != e2[i] && (e1[i]->access != e2[i]->access ||
+                !da_policy_expr_equal(e1[i]->expr, e2[i]->expr))) {
                 return FALSE;
             }
-            e1 = e1->next;
-            e2 = e2->next;
         }
-        return !e1 && !e2;
+        return TRUE;
     }
 }
 
@@ -625,16 +916,19 @@ da_policy_check(
         /* No checks for root user */
         result = DA_ACCESS_ALLOW;
     } else if (policy) {
-        DAPolicyEntry* entry = policy->entries;
+        DAPolicyEntry* const* entries = da_policy_entries(policy);
         DAPolicyCheck check;
+        guint i = policy->count;
         check.cred = cred;
         check.action = action;
         check.arg = arg;
-        while (entry) {
+        /* The last matching entry wins, so walk the list backwards */
+        while (i > 0) {
+            const DAPolicyEntry* entry = entries[--i];
             if (da_policy_expr_match(entry->expr, &check)) {
                 result = entry->access;
+                break;
             }
-            entry = entry->next;
         }
     }
     return result;
@@ -44,7 +44,6 @@
     DA_ACCESS access;
     DAParserEntry* entry;
     DAParserExpr* expr;
-    GSList* list;
 }
 
 /* BISON Declarations */
@@ -70,7 +69,6 @@
 %type <number> user
 %type <number> group
 %type <access> access
-%type <list> entries
 %type <entry> entry
 %type <expr> expr
 %type <expr> term
@@ -83,21 +81,9 @@
 policy:
     version
     | version ';' entries
-    {
-        da_parser_add_entries(parser, $3);
-    }
     | version ';' entries ';'
-    {
-        da_parser_add_entries(parser, $3);
-    }
     | entries
-    {
-        da_parser_add_entries(parser, $1);
-    }
     | entries ';'
-    {
-        da_parser_add_entries(parser, $1);
-    }
 
 version:
     NUMBER
@@ -111,11 +97,11 @@ version:
 entries:
     entry
     {
-        $$ = da_parser_new_link(parser, $1);
+        da_parser_add_entry(parser, $1);
     }
     | entries ';' entry
     {
-        $$ = g_slist_concat($1, da_parser_new_link(parser, $3));
+        da_parser_add_entry(parser, $3);
     }
 
 entry:
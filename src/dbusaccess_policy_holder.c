@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2026 Jolla Ltd.
+ * Copyright (C) 2026 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dbusaccess_policy_holder.h"
+#include "dbusaccess_policy_slot.h"
+#include "dbusaccess_policy_p.h"
+#include "dbusaccess_log.h"
+
+#include <gio/gio.h>
+
+/*
+ * The part of the holder which the compile tasks need. The tasks only
+ * keep a weak reference to the holder itself, which is cleared when the
+ * holder gets finalized. Otherwise the last reference could be dropped
+ * by a worker thread, and the file monitor would be cancelled and freed
+ * there, outside of its context.
+ */
+typedef struct da_policy_holder_file {
+    gint ref_count;
+    GMutex lock;
+    DAPolicyHolder* holder;
+    char* path;
+    DA_ACTION* actions;
+} DAPolicyHolderFile;
+
+struct da_policy_holder {
+    gint ref_count;
+    DAPolicyHolderFile* file;
+    DAPolicySlot* slot;
+    GFileMonitor* monitor;
+    gulong monitor_id;
+    gboolean reloading;
+    gboolean reload_pending;
+};
+
+static
+void
+da_policy_holder_reload(
+    DAPolicyHolder* holder);
+
+static
+void
+da_policy_holder_policy_unref(
+    gpointer policy)
+{
+    da_policy_unref(policy);
+}
+
+static
+DAPolicyHolderFile*
+da_policy_holder_file_new(
+    DAPolicyHolder* holder,
+    const char* path,
+    const DA_ACTION* actions)
+{
+    DAPolicyHolderFile* file = g_slice_new0(DAPolicyHolderFile);
+    file->ref_count = 1;
+    g_mutex_init(&file->lock);
+    file->holder = holder;
+    file->path = g_strdup(path);
+    file->actions = da_policy_actions_copy(actions);
+    return file;
+}
+
+static
+DAPolicyHolderFile*
+da_policy_holder_file_ref(
+    DAPolicyHolderFile* file)
+{
+    g_atomic_int_inc(&file->ref_count);
+    return file;
+}
+
+static
+void
+da_policy_holder_file_unref(
+    gpointer data)
+{
+    DAPolicyHolderFile* file = data;
+    if (g_atomic_int_dec_and_test(&file->ref_count)) {
+        g_mutex_clear(&file->lock);
+        da_policy_actions_free(file->actions);
+        g_free(file->path);
+        g_slice_free(DAPolicyHolderFile, file);
+    }
+}
+
+static
+void
+da_policy_holder_compile(
+    GTask* task,
+    gpointer source,
+    gpointer data,
+    GCancellable* cancel)
+{
+    /* The path and the actions don't change, no locking is needed */
+    DAPolicyHolderFile* file = data;
+    g_task_return_pointer(task, da_policy_new_from_file(file->path,
+        file->actions), da_policy_holder_policy_unref);
+}
+
+static
+void
+da_policy_holder_compiled(
+    GObject* source,
+    GAsyncResult* result,
+    gpointer data)
+{
+    DAPolicyHolderFile* file = data;
+    DAPolicy* policy = g_task_propagate_pointer(G_TASK(result), NULL);
+    DAPolicyHolder* holder;
+
+    /* The holder can't be finalized while the lock is held */
+    g_mutex_lock(&file->lock);
+    holder = file->holder;
+    if (!holder) {
+        GDEBUG("%s is no longer needed", file->path);
+    } else {
+        holder->reloading = FALSE;
+        if (policy) {
+            DAPolicy* current = da_policy_slot_get(holder->slot);
+            if (da_policy_equal(policy, current)) {
+                GDEBUG("%s hasn't changed", file->path);
+            } else {
+                GDEBUG("Loaded %s", file->path);
+                da_policy_slot_set(holder->slot, policy);
+            }
+            da_policy_unref(current);
+        } else {
+            GWARN("Failed to reload %s", file->path);
+        }
+        if (holder->reload_pending) {
+            /* The file has changed again while we were compiling it */
+            holder->reload_pending = FALSE;
+            da_policy_holder_reload(holder);
+        }
+    }
+    g_mutex_unlock(&file->lock);
+    da_policy_unref(policy);
+}
+
+static
+void
+da_policy_holder_reload(
+    DAPolicyHolder* holder)
+{
+    if (holder->reloading) {
+        holder->reload_pending = TRUE;
+    } else {
+        DAPolicyHolderFile* file = holder->file;
+        GTask* task = g_task_new(NULL, NULL, da_policy_holder_compiled,
+            file);
+        holder->reloading = TRUE;
+        /* The task doesn't keep the holder alive, only the file info */
+        g_task_set_task_data(task, da_policy_holder_file_ref(file),
+            da_policy_holder_file_unref);
+        g_task_run_in_thread(task, da_policy_holder_compile);
+        g_object_unref(task);
+    }
+}
+
+static
+void
+da_policy_holder_file_changed(
+    GFileMonitor* monitor,
+    GFile* file,
+    GFile* other,
+    GFileMonitorEvent event,
+    gpointer data)
+{
+    switch (event) {
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_CREATED:
+    case G_FILE_MONITOR_EVENT_MOVED_IN:
+    case G_FILE_MONITOR_EVENT_RENAMED:
+        da_policy_holder_reload(data);
+        break;
+    default:
+        /* If the file is gone, keep using the last policy */
+        break;
+    }
+}
+
+DAPolicyHolder*
+da_policy_holder_new(
+    const char* path,
+    const DA_ACTION* actions)
+{
+    if (path) {
+        DAPolicyHolder* holder = g_slice_new0(DAPolicyHolder);
+        GFile* file = g_file_new_for_path(path);
+        GError* error = NULL;
+        DAPolicy* policy;
+        holder->ref_count = 1;
+        holder->file = da_policy_holder_file_new(holder, path, actions);
+        holder->monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+            NULL, &error);
+        if (holder->monitor) {
+            holder->monitor_id = g_signal_connect(holder->monitor, "changed",
+                G_CALLBACK(da_policy_holder_file_changed), holder);
+        } else {
+            GWARN("%s: %s", path, GERRMSG(error));
+            g_error_free(error);
+        }
+        /* Initial load is synchronous */
+        policy = da_policy_new_from_file(path, actions);
+        holder->slot = da_policy_slot_new(policy);
+        da_policy_unref(policy);
+        g_object_unref(file);
+        return holder;
+    }
+    return NULL;
+}
+
+static
+void
+da_policy_holder_finalize(
+    DAPolicyHolder* holder)
+{
+    if (holder->monitor) {
+        g_signal_handler_disconnect(holder->monitor, holder->monitor_id);
+        g_file_monitor_cancel(holder->monitor);
+        g_object_unref(holder->monitor);
+    }
+    /* A compile task may still be running, let it know */
+    g_mutex_lock(&holder->file->lock);
+    holder->file->holder = NULL;
+    g_mutex_unlock(&holder->file->lock);
+    da_policy_holder_file_unref(holder->file);
+    da_policy_slot_unref(holder->slot);
+}
+
+DAPolicyHolder*
+da_policy_holder_ref(
+    DAPolicyHolder* holder)
+{
+    if (holder) {
+        g_atomic_int_inc(&holder->ref_count);
+    }
+    return holder;
+}
+
+void
+da_policy_holder_unref(
+    DAPolicyHolder* holder)
+{
+    if (holder) {
+        if (g_atomic_int_dec_and_test(&holder->ref_count)) {
+            da_policy_holder_finalize(holder);
+            g_slice_free(DAPolicyHolder, holder);
+        }
+    }
+}
+
+DAPolicy*
+da_policy_holder_get(
+    DAPolicyHolder* holder)
+{
+    return holder ? da_policy_slot_get(holder->slot) : NULL;
+}
+
+DA_ACCESS
+da_policy_holder_check(
+    DAPolicyHolder* holder,
+    const DACred* cred,
+    guint action,
+    const char* arg,
+    DA_ACCESS def)
+{
+    return holder ?
+        da_policy_slot_check(holder->slot, cred, action, arg, def) :
+        da_policy_check(NULL, cred, action, arg, def);
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
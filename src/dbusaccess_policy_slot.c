@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2026 Jolla Ltd.
+ * Copyright (C) 2026 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dbusaccess_policy_slot.h"
+#include "dbusaccess_log.h"
+
+/*
+ * This is a variant of epoch based reclamation. Readers register in
+ * the reader counter which corresponds to the current epoch. Each
+ * epoch has a set of counters (stripes), one cache line each, so that
+ * readers running on different threads don't keep bouncing the same
+ * cache line between CPUs. Each thread sticks to its own stripe.
+ *
+ * The writer stores the new policy, advances the epoch and waits until
+ * the counters of the previous epoch drop to zero. Readers arriving
+ * after that can only see the new policy. A reader which has seen the
+ * epoch change while registering itself, steps back and tries again.
+ */
+
+#define DA_POLICY_SLOT_STRIPES (16)
+#define DA_POLICY_SLOT_CACHE_LINE (64)
+
+typedef union da_policy_slot_counter {
+    gint count;
+    char pad[DA_POLICY_SLOT_CACHE_LINE];
+} DAPolicySlotCounter;
+
+struct da_policy_slot {
+    DAPolicySlotCounter readers[2][DA_POLICY_SLOT_STRIPES];
+    DAPolicy* policy;
+    guint epoch;
+    gint ref_count;
+    GMutex writer;
+};
+
+static GPrivate da_policy_slot_stripe_key;
+static gint da_policy_slot_next_stripe;
+
+static
+guint
+da_policy_slot_stripe(
+    void)
+{
+    /* Zero means that the stripe hasn't been assigned yet */
+    guint stripe = GPOINTER_TO_UINT(g_private_get(&da_policy_slot_stripe_key));
+    if (!stripe) {
+        stripe = (((guint)g_atomic_int_add(&da_policy_slot_next_stripe, 1)) %
+            DA_POLICY_SLOT_STRIPES) + 1;
+        g_private_set(&da_policy_slot_stripe_key, GUINT_TO_POINTER(stripe));
+    }
+    return stripe - 1;
+}
+
+static
+gint*
+da_policy_slot_read_lock(
+    DAPolicySlot* slot)
+{
+    const guint stripe = da_policy_slot_stripe();
+    for (;;) {
+        const guint epoch = g_atomic_int_get(&slot->epoch);
+        gint* count = &slot->readers[epoch & 1][stripe].count;
+        g_atomic_int_inc(count);
+        if (g_atomic_int_get(&slot->epoch) == epoch) {
+            return count;
+        }
+        /* The writer has just advanced the epoch, try again */
+        g_atomic_int_add(count, -1);
+    }
+}
+
+static inline
+void
+da_policy_slot_read_unlock(
+    gint* count)
+{
+    g_atomic_int_add(count, -1);
+}
+
+DAPolicySlot*
+da_policy_slot_new(
+    DAPolicy* policy)
+{
+    DAPolicySlot* slot = g_new0(DAPolicySlot, 1);
+    slot->ref_count = 1;
+    slot->policy = da_policy_ref(policy);
+    g_mutex_init(&slot->writer);
+    return slot;
+}
+
+DAPolicySlot*
+da_policy_slot_ref(
+    DAPolicySlot* slot)
+{
+    if (slot) {
+        g_atomic_int_inc(&slot->ref_count);
+    }
+    return slot;
+}
+
+void
+da_policy_slot_unref(
+    DAPolicySlot* slot)
+{
+    if (slot) {
+        if (g_atomic_int_dec_and_test(&slot->ref_count)) {
+            da_policy_unref(slot->policy);
+            g_mutex_clear(&slot->writer);
+            g_free(slot);
+        }
+    }
+}
+
+DAPolicy*
+da_policy_slot_get(
+    DAPolicySlot* slot)
+{
+    if (slot) {
+        gint* lock = da_policy_slot_read_lock(slot);
+        DAPolicy* policy = da_policy_ref(g_atomic_pointer_get(&slot->policy));
+        da_policy_slot_read_unlock(lock);
+        return policy;
+    }
+    return NULL;
+}
+
+void
+da_policy_slot_set(
+    DAPolicySlot* slot,
+    DAPolicy* policy)
+{
+    if (slot) {
+        DAPolicy* prev;
+        DAPolicySlotCounter* readers;
+        guint epoch, i;
+
+        g_mutex_lock(&slot->writer);
+        prev = slot->policy;
+        if (prev == policy) {
+            g_mutex_unlock(&slot->writer);
+            return;
+        }
+        g_atomic_pointer_set(&slot->policy, da_policy_ref(policy));
+        epoch = slot->epoch;
+        g_atomic_int_set(&slot->epoch, epoch + 1);
+
+        /* Wait for the readers which may still be looking at prev */
+        readers = slot->readers[epoch & 1];
+        for (i = 0; i < DA_POLICY_SLOT_STRIPES; i++) {
+            while (g_atomic_int_get(&readers[i].count)) {
+                g_thread_yield();
+            }
+        }
+        g_mutex_unlock(&slot->writer);
+        da_policy_unref(prev);
+    }
+}
+
+DA_ACCESS
+da_policy_slot_check(
+    DAPolicySlot* slot,
+    const DACred* cred,
+    guint action,
+    const char* arg,
+    DA_ACCESS def)
+{
+    if (slot) {
+        gint* lock = da_policy_slot_read_lock(slot);
+        const DA_ACCESS access = da_policy_check(g_atomic_pointer_get
+            (&slot->policy), cred, action, arg, def);
+        da_policy_slot_read_unlock(lock);
+        return access;
+    } else {
+        return da_policy_check(NULL, cred, action, arg, def);
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
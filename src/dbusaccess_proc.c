@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dbusaccess_proc_p.h"
+#include "dbusaccess_cred_p.h"
+#include "dbusaccess_log.h"
+
+#include <gutil_macros.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct da_proc_priv {
+    DAProc pub;
+    DACredPriv cred;
+    gint ref_count;
+    gint64 created;
+    int pidfd; /* Refers to the process which /proc has been read from */
+} DAProcPriv;
+
+/*
+ * The table is keyed by pid and doesn't hold references. A record is
+ * removed from it when the last reference is gone, or replaced by a
+ * newer one. The reference count is protected by the same lock,
+ * otherwise a lookup could resurrect a dying record.
+ */
+static GMutex da_proc_lock;
+static GHashTable* da_proc_table;
+
+static inline DAProcPriv* da_proc_cast(DAProc* proc)
+    { return G_CAST(proc, DAProcPriv, pub); }
+
+static
+DAProcPriv*
+da_proc_new(
+    guint pid)
+{
+    char* fname = g_strdup_printf("/proc/%u/status", pid);
+    DAProcPriv* priv = NULL;
+    GError* error = NULL;
+    gchar* data = NULL;
+    gsize len = 0;
+    if (g_file_get_contents(fname, &data, &len, &error)) {
+        GDEBUG("Parsing %s", fname);
+        priv = g_slice_new0(DAProcPriv);
+        if (da_cred_parse(&priv->pub.cred, &priv->cred, data, len)) {
+            priv->pub.pid = pid;
+            priv->ref_count = 1;
+            priv->created = g_get_monotonic_time();
+            priv->pidfd = -1;
+        } else {
+            da_cred_priv_cleanup(&priv->cred);
+            g_slice_free(DAProcPriv, priv);
+            priv = NULL;
+        }
+        g_free(data);
+    } else {
+        GDEBUG("%s: %s", fname, GERRMSG(error));
+        g_error_free(error);
+    }
+    g_free(fname);
+    return priv;
+}
+
+static
+void
+da_proc_free(
+    DAProcPriv* priv)
+{
+    if (priv->pidfd >= 0) {
+        close(priv->pidfd);
+    }
+    da_cred_priv_cleanup(&priv->cred);
+    g_slice_free(DAProcPriv, priv);
+}
+
+gboolean
+da_proc_exited(
+    int pidfd)
+{
+    struct pollfd pfd;
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = pidfd;
+    pfd.events = POLLIN;
+    /* pidfd becomes readable when the process exits */
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+DAProc*
+da_proc_get(
+    guint pid,
+    int pidfd,
+    guint max_age_sec)
+{
+    DAProcPriv* priv = NULL;
+
+    if (pidfd >= 0 && max_age_sec) {
+        g_mutex_lock(&da_proc_lock);
+        priv = da_proc_table ? g_hash_table_lookup(da_proc_table,
+            GUINT_TO_POINTER(pid)) : NULL;
+        /*
+         * As long as the process which the record has been read from is
+         * alive, the pid can't have been reused. Whether it's the same
+         * process the caller is asking about is up to the caller to
+         * check, with its own pidfd, after this call. So no /proc reads
+         * are needed here.
+         */
+        if (priv && priv->created > (g_get_monotonic_time() -
+            max_age_sec * G_TIME_SPAN_SECOND) &&
+            !da_proc_exited(priv->pidfd)) {
+            priv->ref_count++;
+        } else {
+            /* The process may have changed its credentials since then */
+            priv = NULL;
+        }
+        g_mutex_unlock(&da_proc_lock);
+    }
+
+    if (!priv) {
+        priv = da_proc_new(pid);
+        if (priv && pidfd >= 0) {
+            /*
+             * If the process is still alive after /proc/pid/status has
+             * been read, then that's what has been read.
+             */
+            if (da_proc_exited(pidfd)) {
+                GDEBUG("Process %u is gone", pid);
+                da_proc_free(priv);
+                priv = NULL;
+            } else {
+                priv->pidfd = fcntl(pidfd, F_DUPFD_CLOEXEC, 0);
+                if (priv->pidfd < 0) {
+                    GDEBUG("Failed to dup pidfd: %s", strerror(errno));
+                }
+            }
+        }
+        if (priv && priv->pidfd >= 0) {
+            DAProcPriv* other;
+            g_mutex_lock(&da_proc_lock);
+            if (!da_proc_table) {
+                da_proc_table = g_hash_table_new(g_direct_hash,
+                    g_direct_equal);
+            }
+            other = g_hash_table_lookup(da_proc_table, GUINT_TO_POINTER(pid));
+            if (other && other->created >= priv->created) {
+                /* Another thread has been faster */
+                other->ref_count++;
+            } else {
+                /* The older record (if any) remains valid but unshared */
+                g_hash_table_replace(da_proc_table, GUINT_TO_POINTER(pid),
+                    priv);
+                other = NULL;
+            }
+            g_mutex_unlock(&da_proc_lock);
+            if (other) {
+                da_proc_free(priv);
+                priv = other;
+            }
+        }
+    }
+    return priv ? &priv->pub : NULL;
+}
+
+DAProc*
+da_proc_ref(
+    DAProc* proc)
+{
+    if (proc) {
+        DAProcPriv* priv = da_proc_cast(proc);
+        g_mutex_lock(&da_proc_lock);
+        priv->ref_count++;
+        g_mutex_unlock(&da_proc_lock);
+    }
+    return proc;
+}
+
+void
+da_proc_unref(
+    DAProc* proc)
+{
+    if (proc) {
+        DAProcPriv* priv = da_proc_cast(proc);
+        gboolean last;
+        g_mutex_lock(&da_proc_lock);
+        last = !--priv->ref_count;
+        if (last && da_proc_table && g_hash_table_lookup(da_proc_table,
+            GUINT_TO_POINTER(proc->pid)) == priv) {
+            g_hash_table_remove(da_proc_table, GUINT_TO_POINTER(proc->pid));
+            if (!g_hash_table_size(da_proc_table)) {
+                g_hash_table_destroy(da_proc_table);
+                da_proc_table = NULL;
+            }
+        }
+        g_mutex_unlock(&da_proc_lock);
+        if (last) {
+            da_proc_free(priv);
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ * Copyright (C) 2020 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DBUSACCESS_PROC_PRIVATE_H
+#define DBUSACCESS_PROC_PRIVATE_H
+
+#include "dbusaccess_types.h"
+
+/*
+ * Credentials of a process, shared by all the peers which belong to it.
+ * A record is only shared while the process which it has been read from
+ * is alive, which is what the pidfd is for. Without a pidfd the record
+ * isn't shared at all. Since a process can change its credentials, a
+ * record is only reused if it's younger than max_age_sec, zero
+ * max_age_sec forces /proc to be read.
+ */
+typedef struct da_proc {
+    guint pid;
+    DACred cred;
+} DAProc;
+
+DAProc*
+da_proc_get(
+    guint pid,
+    int pidfd,
+    guint max_age_sec)
+    G_GNUC_INTERNAL;
+
+DAProc*
+da_proc_ref(
+    DAProc* proc)
+    G_GNUC_INTERNAL;
+
+void
+da_proc_unref(
+    DAProc* proc)
+    G_GNUC_INTERNAL;
+
+/* TRUE if the process referred to by the pidfd has exited */
+gboolean
+da_proc_exited(
+    int pidfd)
+    G_GNUC_INTERNAL;
+
+#endif /* DBUSACCESS_PROC_PRIVATE_H */
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
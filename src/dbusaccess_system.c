@@ -35,29 +35,65 @@
 
 #include <pwd.h>
 #include <grp.h>
+#include <errno.h>
+#include <unistd.h>
+
+/*
+ * Reentrant versions of getpwnam and getgrnam are used because
+ * policies may be compiled on any thread (see da_policy_new_lazy)
+ */
+
+static
+gsize
+da_system_buf_size(
+    int name)
+{
+    const long size = sysconf(name);
+    return (size > 0) ? size : 1024;
+}
 
 int
 da_system_uid(
     const char* user)
 {
-    const struct passwd *pw = getpwnam(user);
-    if (pw) {
+    gsize size = da_system_buf_size(_SC_GETPW_R_SIZE_MAX);
+    char* buf = g_malloc(size);
+    struct passwd pwbuf;
+    struct passwd* pw = NULL;
+    int uid = -1;
+    int err;
+    while ((err = getpwnam_r(user, &pwbuf, buf, size, &pw)) == ERANGE) {
+        size *= 2;
+        buf = g_realloc(buf, size);
+    }
+    if (!err && pw) {
         GVERBOSE_("%s => %d", user, (int)pw->pw_uid);
-        return pw->pw_uid;
+        uid = pw->pw_uid;
     }
-    return -1;
+    g_free(buf);
+    return uid;
 }
 
 int
 da_system_gid(
     const char* group)
 {
-    const struct group *gr = getgrnam(group);
-    if (gr) {
+    gsize size = da_system_buf_size(_SC_GETGR_R_SIZE_MAX);
+    char* buf = g_malloc(size);
+    struct group grbuf;
+    struct group* gr = NULL;
+    int gid = -1;
+    int err;
+    while ((err = getgrnam_r(group, &grbuf, buf, size, &gr)) == ERANGE) {
+        size *= 2;
+        buf = g_realloc(buf, size);
+    }
+    if (!err && gr) {
         GVERBOSE_("%s => %d", group, (int)gr->gr_gid);
-        return gr->gr_gid;
+        gid = gr->gr_gid;
     }
-    return -1;
+    g_free(buf);
+    return gid;
 }
 
 /*
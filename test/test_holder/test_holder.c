@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2026 Jolla Ltd.
+ * Copyright (C) 2026 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test_common.h"
+
+#include "dbusaccess_policy_holder.h"
+
+#include <glib/gstdio.h>
+
+static TestOpt test_opt;
+
+#define V DA_POLICY_VERSION
+#define TEST_TIMEOUT_SEC (10)
+
+static
+gboolean
+test_timeout(
+    gpointer data)
+{
+    g_assert_not_reached();
+    return G_SOURCE_REMOVE;
+}
+
+static
+DA_ACCESS
+test_holder_check(
+    DAPolicyHolder* holder)
+{
+    static const DACred user = { 1, 1, NULL, 0, 0, 0 };
+    return da_policy_holder_check(holder, &user, 1, "a", DA_ACCESS_ALLOW);
+}
+
+static
+void
+test_holder_wait(
+    DAPolicyHolder* holder,
+    DA_ACCESS access)
+{
+    guint id = g_timeout_add_seconds(TEST_TIMEOUT_SEC, test_timeout, NULL);
+    while (test_holder_check(holder) != access) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_source_remove(id);
+}
+
+/*==========================================================================*
+ * Null
+ *==========================================================================*/
+
+static
+void
+test_holder_null(
+    void)
+{
+    g_assert(!da_policy_holder_new(NULL, NULL));
+    g_assert(!da_policy_holder_ref(NULL));
+    g_assert(!da_policy_holder_get(NULL));
+    da_policy_holder_unref(NULL);
+    g_assert(da_policy_holder_check(NULL, NULL, 0, NULL, DA_ACCESS_ALLOW) ==
+        DA_ACCESS_ALLOW);
+    g_assert(da_policy_holder_check(NULL, NULL, 0, NULL, DA_ACCESS_DENY) ==
+        DA_ACCESS_DENY);
+}
+
+/*==========================================================================*
+ * Reload
+ *==========================================================================*/
+
+static
+void
+test_holder_reload(
+    void)
+{
+    static const DA_ACTION foo [] = {
+        { "foo", 1, 1 },
+        { NULL }
+    };
+    static const char spec1[] = V ";foo(a)=deny";
+    static const char spec2[] = V ";foo(b)=deny";
+    char* dir = g_dir_make_tmp("test_holder_XXXXXX", NULL);
+    char* file = g_build_filename(dir, "policy", NULL);
+    DAPolicyHolder* holder;
+    DAPolicy* policy;
+    DAPolicy* policy2;
+
+    /* No file yet */
+    holder = da_policy_holder_new(file, foo);
+    g_assert(holder);
+    g_assert(!da_policy_holder_get(holder));
+    g_assert(test_holder_check(holder) == DA_ACCESS_ALLOW);
+
+    /* File gets created */
+    g_assert(g_file_set_contents(file, spec1, -1, NULL));
+    test_holder_wait(holder, DA_ACCESS_DENY);
+    policy = da_policy_holder_get(holder);
+    policy2 = da_policy_new_full(spec1, foo);
+    g_assert(da_policy_equal(policy, policy2));
+    da_policy_unref(policy2);
+
+    /* The old policy remains valid after it's been replaced */
+    g_assert(g_file_set_contents(file, spec2, -1, NULL));
+    test_holder_wait(holder, DA_ACCESS_ALLOW);
+    policy2 = da_policy_holder_get(holder);
+    g_assert(policy2 != policy);
+    g_assert(da_policy_check(policy, NULL, 1, "a", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_DENY);
+    da_policy_unref(policy);
+    da_policy_unref(policy2);
+    da_policy_holder_unref(holder);
+
+    /* Initial load is synchronous */
+    holder = da_policy_holder_new(file, foo);
+    policy = da_policy_holder_get(holder);
+    g_assert(policy);
+    da_policy_unref(policy);
+    da_policy_holder_unref(da_policy_holder_ref(holder));
+    da_policy_holder_unref(holder);
+
+    g_remove(file);
+    g_rmdir(dir);
+    g_free(file);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Drop
+ *==========================================================================*/
+
+static
+void
+test_holder_drop_changed(
+    GFileMonitor* monitor,
+    GFile* file,
+    GFile* other,
+    GFileMonitorEvent event,
+    gpointer data)
+{
+    if (event == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT) {
+        *(gboolean*)data = TRUE;
+    }
+}
+
+static
+gboolean
+test_holder_drop_done(
+    gpointer data)
+{
+    *(gboolean*)data = TRUE;
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+test_holder_drop(
+    void)
+{
+    static const DA_ACTION foo [] = {
+        { "foo", 1, 1 },
+        { NULL }
+    };
+    char* dir = g_dir_make_tmp("test_holder_XXXXXX", NULL);
+    char* path = g_build_filename(dir, "policy", NULL);
+    GFile* file = g_file_new_for_path(path);
+    DAPolicyHolder* holder = da_policy_holder_new(path, foo);
+    GFileMonitor* monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+        NULL, NULL);
+    gboolean changed = FALSE, done = FALSE;
+    guint id;
+
+    /* Wait until the change has been noticed */
+    g_assert(monitor);
+    g_signal_connect(monitor, "changed",
+        G_CALLBACK(test_holder_drop_changed), &changed);
+    g_assert(g_file_set_contents(path, V ";foo(a)=deny", -1, NULL));
+    id = g_timeout_add_seconds(TEST_TIMEOUT_SEC, test_timeout, NULL);
+    while (!changed) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_source_remove(id);
+
+    /* Most likely, the reload completes after the holder is gone */
+    da_policy_holder_unref(holder);
+    g_timeout_add(500, test_holder_drop_done, &done);
+    while (!done) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    g_file_monitor_cancel(monitor);
+    g_object_unref(monitor);
+    g_object_unref(file);
+    g_remove(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_PREFIX "/holder/"
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_PREFIX "null", test_holder_null);
+    g_test_add_func(TEST_PREFIX "reload", test_holder_reload);
+    g_test_add_func(TEST_PREFIX "drop", test_holder_drop);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,1707 @@
+/*
+ * Copyright (C) 2019 Jolla Ltd.
+ * Copyright (C) 2019 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test_common.h"
+
+#include "dbusaccess_peer.h"
+#include "dbusaccess_policy.h"
+#include "dbusaccess_proc_p.h"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+static TestOpt test_opt;
+static GTestDBus* test_dbus;
+
+/* The private bus started by main() is the session bus */
+#define TEST_BUS DA_BUS_SESSION
+#define TEST_NAME "org.example.dbusaccess.Test"
+#define TEST_PATH "/test"
+#define TEST_IFACE "org.example.dbusaccess.Test"
+#define TEST_METHOD "Call"
+#define TEST_NO_SUCH_NAME ":1.1000000"
+#define TEST_TIMEOUT_SEC (10)
+
+#define V DA_POLICY_VERSION
+
+typedef gboolean (*TestPeerCondFunc)(gpointer data);
+
+static
+gboolean
+test_peer_tick(
+    gpointer data)
+{
+    /* Makes sure that the loop wakes up once in a while */
+    return G_SOURCE_CONTINUE;
+}
+
+static
+void
+test_peer_wait(
+    TestPeerCondFunc cond,
+    gpointer data)
+{
+    const gint64 deadline = g_get_monotonic_time() +
+        TEST_TIMEOUT_SEC * G_TIME_SPAN_SECOND;
+    const guint id = g_timeout_add(10, test_peer_tick, NULL);
+    while (!cond(data)) {
+        g_assert(g_get_monotonic_time() < deadline);
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_source_remove(id);
+}
+
+static
+void
+test_peer_stats(
+    DAPeerStats* stats)
+{
+    g_assert(da_peer_stats(TEST_BUS, stats));
+}
+
+/* Number of the queries which have been completed */
+static
+guint64
+test_peer_queries(
+    void)
+{
+    DAPeerStats stats;
+    guint64 n = 0;
+    guint i;
+    test_peer_stats(&stats);
+    for (i = 0; i < DA_PEER_STATS_LATENCY_BUCKETS; i++) {
+        n += stats.latency[i];
+    }
+    return n;
+}
+
+static
+gboolean
+test_peer_size_cond(
+    gpointer data)
+{
+    DAPeerStats stats;
+    test_peer_stats(&stats);
+    return stats.size == GPOINTER_TO_UINT(data);
+}
+
+static
+gboolean
+test_peer_aliases_cond(
+    gpointer data)
+{
+    DAPeerStats stats;
+    test_peer_stats(&stats);
+    return stats.aliases == GPOINTER_TO_UINT(data);
+}
+
+static
+gboolean
+test_peer_vanished_cond(
+    gpointer data)
+{
+    DAPeerStats stats;
+    test_peer_stats(&stats);
+    return stats.vanished > *(guint64*)data;
+}
+
+static
+gboolean
+test_peer_count_cond(
+    gpointer data)
+{
+    return !*(int*)data;
+}
+
+/* Restores the defaults and empties the cache */
+static
+void
+test_peer_reset(
+    void)
+{
+    da_peer_set_cache_limits(TEST_BUS, 30, 0);
+    da_peer_set_negative_cache_limits(TEST_BUS, 5, 1024);
+    da_peer_set_stale_timeout(TEST_BUS, 0);
+    da_peer_set_prefetch(TEST_BUS, NULL, NULL, NULL);
+    da_peer_flush(TEST_BUS, NULL);
+}
+
+/* The connection used by the library */
+static
+GDBusConnection*
+test_peer_bus(
+    void)
+{
+    GDBusConnection* bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+    g_assert(bus);
+    return bus;
+}
+
+/* Another client of the same bus, owned by the same process */
+static
+GDBusConnection*
+test_peer_connect(
+    void)
+{
+    GDBusConnection* connection = g_dbus_connection_new_for_address_sync
+        (g_test_dbus_get_bus_address(test_dbus),
+        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+        G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION, NULL, NULL, NULL);
+    g_assert(connection);
+    return connection;
+}
+
+static
+guint
+test_peer_call_bus(
+    GDBusConnection* connection,
+    const char* method,
+    GVariant* args)
+{
+    guint result = 0;
+    GVariant* ret = g_dbus_connection_call_sync(connection,
+        "org.freedesktop.DBus", "/org/freedesktop/DBus",
+        "org.freedesktop.DBus", method, args, G_VARIANT_TYPE("(u)"),
+        G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+    g_assert(ret);
+    g_variant_get(ret, "(u)", &result);
+    g_variant_unref(ret);
+    return result;
+}
+
+static
+void
+test_peer_own_name(
+    GDBusConnection* connection)
+{
+    /* DBUS_NAME_FLAG_DO_NOT_QUEUE => DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER */
+    g_assert_cmpuint(test_peer_call_bus(connection, "RequestName",
+        g_variant_new("(su)", TEST_NAME, 4)), ==, 1);
+}
+
+static
+void
+test_peer_release_name(
+    GDBusConnection* connection)
+{
+    /* DBUS_RELEASE_NAME_REPLY_RELEASED */
+    g_assert_cmpuint(test_peer_call_bus(connection, "ReleaseName",
+        g_variant_new("(s)", TEST_NAME)), ==, 1);
+}
+
+typedef struct test_peer_async {
+    int pending;
+    int cancelled;
+    DAPeer* peer[2];
+    int n;
+} TestPeerAsync;
+
+static
+void
+test_peer_async_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    TestPeerAsync* test = user_data;
+    GError* error = NULL;
+    DAPeer* peer = da_peer_get_finish(result, &error);
+    g_assert(test->n < (int)G_N_ELEMENTS(test->peer));
+    if (error) {
+        g_assert(!peer);
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            test->cancelled++;
+        }
+        g_error_free(error);
+    }
+    test->peer[test->n++] = da_peer_ref(peer);
+    test->pending--;
+}
+
+/*==========================================================================*
+ * Async
+ *==========================================================================*/
+
+static
+void
+test_peer_async(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    GCancellable* cancel;
+    TestPeerAsync test;
+
+    /* This is the first test, so the lookup has to connect first */
+    test_peer_reset();
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, self, NULL, test_peer_async_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert(test.peer[0]);
+    g_assert_cmpstr(test.peer[0]->name, ==, self);
+    g_assert_cmpint(test.peer[0]->pid, ==, getpid());
+    g_assert_cmpuint(test.peer[0]->cred.euid, ==, geteuid());
+    da_peer_unref(test.peer[0]);
+
+    /* Cancelled lookup completes without waiting for the query */
+    da_peer_flush(TEST_BUS, NULL);
+    memset(&test, 0, sizeof(test));
+    cancel = g_cancellable_new();
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, self, cancel, test_peer_async_done, &test);
+    g_cancellable_cancel(cancel);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert_cmpint(test.cancelled, ==, 1);
+    g_assert(!test.peer[0]);
+
+    /* But the query keeps going and its result gets cached */
+    test_peer_wait(test_peer_size_cond, GUINT_TO_POINTER(1));
+
+    /* Cancellation is reported even if the peer is cached */
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, self, cancel, test_peer_async_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert_cmpint(test.cancelled, ==, 1);
+    g_assert(!test.peer[0]);
+    g_object_unref(cancel);
+
+    /* Missing name fails */
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, NULL, NULL, test_peer_async_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert(!test.peer[0]);
+    g_assert(!test.cancelled);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Basic
+ *==========================================================================*/
+
+static
+void
+test_peer_basic(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    DAPeerStats stats;
+    guint64 queries;
+    DAPeer* peer;
+
+    test_peer_reset();
+    queries = test_peer_queries();
+
+    /* NULL resistance */
+    g_assert(!da_peer_get(TEST_BUS, NULL));
+    g_assert(!da_peer_ref(NULL));
+    da_peer_unref(NULL);
+    g_assert(!da_peer_stats(TEST_BUS, NULL));
+
+    peer = da_peer_get(TEST_BUS, self);
+    g_assert(peer);
+    g_assert(peer->bus == TEST_BUS);
+    g_assert_cmpstr(peer->name, ==, self);
+    g_assert_cmpint(peer->pid, ==, getpid());
+    g_assert_cmpuint(peer->cred.euid, ==, geteuid());
+
+    /* The second lookup is served from the cache */
+    g_assert(da_peer_get(TEST_BUS, self) == peer);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 1);
+
+    /* Flush it */
+    da_peer_flush(TEST_BUS, self);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 0);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Coalesce
+ *==========================================================================*/
+
+static
+void
+test_peer_coalesce(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    TestPeerAsync test;
+    guint64 queries;
+    DAPeer* peer;
+
+    test_peer_reset();
+    queries = test_peer_queries();
+    memset(&test, 0, sizeof(test));
+
+    /* Two asynchronous lookups and a synchronous one share the query */
+    test.pending = 2;
+    da_peer_get_async(TEST_BUS, self, NULL, test_peer_async_done, &test);
+    da_peer_get_async(TEST_BUS, self, NULL, test_peer_async_done, &test);
+    peer = da_peer_get(TEST_BUS, self);
+    g_assert(peer);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert(test.peer[0] == peer);
+    g_assert(test.peer[1] == peer);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+    da_peer_unref(test.peer[0]);
+    da_peer_unref(test.peer[1]);
+
+    /* Cached now */
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, self, NULL, test_peer_async_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert(test.peer[0] == peer);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+    da_peer_unref(test.peer[0]);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Cred
+ *==========================================================================*/
+
+static
+void
+test_peer_cred(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    TestPeerAsync test;
+    DAPeerStats stats;
+    guint64 failures;
+    DAPeer* peer;
+
+    test_peer_reset();
+    test_peer_stats(&stats);
+    failures = stats.proc_failures;
+
+    /* What the bus doesn't supply is read from /proc on the way out */
+    peer = da_peer_get(TEST_BUS, self);
+    g_assert(peer);
+    g_assert_cmpuint(peer->cred.euid, ==, geteuid());
+    g_assert_cmpuint(peer->cred.egid, ==, getegid());
+    g_assert(peer->cred.flags & DBUSACCESS_CRED_GROUPS);
+
+    /* The same peer comes out of the asynchronous path */
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, self, NULL, test_peer_async_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert(test.peer[0] == peer);
+    da_peer_unref(test.peer[0]);
+
+    /* And the same after a flush */
+    da_peer_flush(TEST_BUS, NULL);
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, self, NULL, test_peer_async_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert(test.peer[0]);
+    g_assert_cmpuint(test.peer[0]->cred.euid, ==, geteuid());
+    g_assert_cmpuint(test.peer[0]->cred.egid, ==, getegid());
+    da_peer_unref(test.peer[0]);
+
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.proc_failures, ==, failures);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Proc
+ *==========================================================================*/
+
+static
+void
+test_peer_proc(
+    void)
+{
+    const guint pid = getpid();
+    DAProc* proc1 = da_proc_get(pid, -1, 30);
+    DAProc* proc2 = da_proc_get(pid, -1, 30);
+    DAProc* proc3;
+    int pidfd = -1;
+
+    /* Without a pidfd nothing gets shared */
+    g_assert(proc1);
+    g_assert(proc2);
+    g_assert(proc1 != proc2);
+    g_assert_cmpuint(proc1->pid, ==, pid);
+    g_assert_cmpuint(proc1->cred.euid, ==, geteuid());
+    g_assert_cmpuint(proc1->cred.egid, ==, getegid());
+    da_proc_unref(da_proc_ref(proc1));
+    da_proc_unref(proc1);
+    da_proc_unref(proc2);
+
+    /* No such process */
+    g_assert(!da_proc_get(0, -1, 30));
+
+#ifdef __NR_pidfd_open
+    pidfd = syscall(__NR_pidfd_open, pid, 0);
+#endif
+    if (pidfd < 0) {
+        /* Old kernel, nothing else to test */
+        return;
+    }
+
+    /* Lookups made close together share the record */
+    g_assert(!da_proc_exited(pidfd));
+    proc1 = da_proc_get(pid, pidfd, 30);
+    proc2 = da_proc_get(pid, pidfd, 30);
+    g_assert(proc1);
+    g_assert(proc1 == proc2);
+    da_proc_unref(proc2);
+
+    /* Zero max age forces /proc to be read again */
+    proc2 = da_proc_get(pid, pidfd, 0);
+    g_assert(proc2);
+    g_assert(proc2 != proc1);
+    g_assert_cmpuint(proc2->cred.euid, ==, proc1->cred.euid);
+
+    /* The newer record replaces the old one */
+    proc3 = da_proc_get(pid, pidfd, 30);
+    g_assert(proc3 == proc2);
+    da_proc_unref(proc3);
+    da_proc_unref(proc1);
+    da_proc_unref(proc2);
+    close(pidfd);
+}
+
+/*==========================================================================*
+ * Loop
+ *==========================================================================*/
+
+static
+void
+test_peer_loop(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    const gint64 deadline = g_get_monotonic_time() +
+        TEST_TIMEOUT_SEC * G_TIME_SPAN_SECOND;
+    TestPeerAsync test;
+    int fd;
+
+    test_peer_reset();
+    fd = da_peer_fd();
+    g_assert(fd >= 0);
+    g_assert_cmpint(da_peer_fd(), ==, fd);
+
+    /* Nothing to do yet */
+    da_peer_dispatch();
+
+    /* The whole lookup is driven by da_peer_dispatch */
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, self, NULL, test_peer_async_done, &test);
+    while (test.pending) {
+        const int timeout = da_peer_next_timeout();
+        struct pollfd pfd;
+
+        g_assert(g_get_monotonic_time() < deadline);
+        memset(&pfd, 0, sizeof(pfd));
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, (timeout >= 0 && timeout < 100) ? timeout : 100);
+        da_peer_dispatch();
+    }
+    g_assert(test.peer[0]);
+    g_assert_cmpstr(test.peer[0]->name, ==, self);
+    g_assert_cmpint(test.peer[0]->pid, ==, getpid());
+    da_peer_unref(test.peer[0]);
+
+    /* Explicit expiration */
+    da_peer_set_cache_limits(TEST_BUS, 1, 0);
+    g_usleep(G_USEC_PER_SEC + G_USEC_PER_SEC / 10);
+    da_peer_expire(TEST_BUS);
+    g_assert(test_peer_size_cond(GUINT_TO_POINTER(0)));
+
+    test_peer_reset();
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Alias
+ *==========================================================================*/
+
+static
+void
+test_peer_alias(
+    void)
+{
+    GDBusConnection* c = test_peer_connect();
+    const char* owner = g_dbus_connection_get_unique_name(c);
+    DAPeerStats stats;
+    guint64 queries;
+    DAPeer* peer;
+
+    test_peer_reset();
+    test_peer_own_name(c);
+    queries = test_peer_queries();
+
+    /* Resolved and queried in one go, the requested name is kept */
+    peer = da_peer_get(TEST_BUS, TEST_NAME);
+    g_assert(peer);
+    g_assert_cmpstr(peer->name, ==, TEST_NAME);
+    g_assert_cmpint(peer->pid, ==, getpid());
+    g_assert_cmpuint(peer->cred.euid, ==, geteuid());
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+
+    /* The owner has been cached too */
+    g_assert(da_peer_get(TEST_BUS, TEST_NAME) == peer);
+    peer = da_peer_get(TEST_BUS, owner);
+    g_assert(peer);
+    g_assert_cmpstr(peer->name, ==, owner);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 2);
+    g_assert_cmpuint(stats.aliases, ==, 1);
+
+    /* Flushing the well-known name flushes the owner too */
+    da_peer_flush(TEST_BUS, TEST_NAME);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 0);
+    g_assert_cmpuint(stats.aliases, ==, 0);
+
+    /* Well-known names count towards the size limit */
+    da_peer_set_cache_limits(TEST_BUS, 30, 1);
+    peer = da_peer_get(TEST_BUS, TEST_NAME);
+    g_assert(peer);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 1);
+    g_assert_cmpuint(peer->cred.euid, ==, geteuid());
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 2);
+    da_peer_set_cache_limits(TEST_BUS, 30, 0);
+
+    /* NameOwnerChanged drops it */
+    test_peer_release_name(c);
+    test_peer_wait(test_peer_aliases_cond, GUINT_TO_POINTER(0));
+    g_assert(!da_peer_get(TEST_BUS, TEST_NAME));
+
+    test_peer_reset();
+    g_dbus_connection_close_sync(c, NULL, NULL);
+    g_object_unref(c);
+}
+
+/*==========================================================================*
+ * Many
+ *==========================================================================*/
+
+typedef struct test_peer_many_thread {
+    GMutex lock;
+    GCond cond;
+    gboolean sent;
+    TestPeerAsync async;
+} TestPeerManyThread;
+
+/* Sends the query, then lets it sit for a while before running the loop */
+static
+gpointer
+test_peer_many_thread(
+    gpointer data)
+{
+    TestPeerManyThread* test = data;
+    GDBusConnection* bus = test_peer_bus();
+    GMainContext* context = g_main_context_new();
+
+    g_assert(g_main_context_acquire(context));
+    g_main_context_push_thread_default(context);
+    test->async.pending = 1;
+    da_peer_get_async(TEST_BUS, g_dbus_connection_get_unique_name(bus),
+        NULL, test_peer_async_done, &test->async);
+    g_mutex_lock(&test->lock);
+    test->sent = TRUE;
+    g_cond_signal(&test->cond);
+    g_mutex_unlock(&test->lock);
+    g_usleep(100000);
+    while (test->async.pending) {
+        g_main_context_iteration(context, TRUE);
+    }
+    g_main_context_pop_thread_default(context);
+    g_main_context_release(context);
+    g_main_context_unref(context);
+    g_object_unref(bus);
+    return NULL;
+}
+
+static
+void
+test_peer_many(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    GDBusConnection* c = test_peer_connect();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    const char* names[5];
+    DAPeer* peers[4];
+    TestPeerManyThread test;
+    GThread* thread;
+    guint64 queries;
+
+    test_peer_reset();
+    test_peer_own_name(c);
+    names[0] = self;
+    names[1] = g_dbus_connection_get_unique_name(c);
+    names[2] = TEST_NAME;
+    names[3] = TEST_NO_SUCH_NAME;
+    names[4] = NULL;
+
+    g_assert_cmpuint(da_peer_get_many(TEST_BUS, NULL, NULL), ==, 0);
+    queries = test_peer_queries();
+    g_assert_cmpuint(da_peer_get_many(TEST_BUS, names, peers), ==, 3);
+    g_assert(peers[0]);
+    g_assert(peers[1]);
+    g_assert(peers[2]);
+    g_assert(!peers[3]);
+    g_assert_cmpstr(peers[0]->name, ==, names[0]);
+    g_assert_cmpstr(peers[1]->name, ==, names[1]);
+    g_assert_cmpstr(peers[2]->name, ==, names[2]);
+    g_assert_cmpint(peers[2]->pid, ==, peers[1]->pid);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 4);
+
+    /* Cached ones (including the failure) don't generate any traffic */
+    queries = test_peer_queries();
+    g_assert_cmpuint(da_peer_get_many(TEST_BUS, names, NULL), ==, 3);
+    g_assert(da_peer_get(TEST_BUS, self) == peers[0]);
+    g_assert_cmpuint(test_peer_queries(), ==, queries);
+
+    /* The same name listed twice is only asked about once */
+    da_peer_flush(TEST_BUS, NULL);
+    queries = test_peer_queries();
+    names[1] = self;
+    names[2] = NULL;
+    g_assert_cmpuint(da_peer_get_many(TEST_BUS, names, peers), ==, 2);
+    g_assert(peers[0] == peers[1]);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+
+    /* And so is the name which another thread is already asking about */
+    da_peer_flush(TEST_BUS, NULL);
+    queries = test_peer_queries();
+    memset(&test, 0, sizeof(test));
+    g_mutex_init(&test.lock);
+    g_cond_init(&test.cond);
+    thread = g_thread_new("test", test_peer_many_thread, &test);
+    g_mutex_lock(&test.lock);
+    while (!test.sent) {
+        g_cond_wait(&test.cond, &test.lock);
+    }
+    g_mutex_unlock(&test.lock);
+    g_assert_cmpuint(da_peer_get_many(TEST_BUS, names, peers), ==, 2);
+    g_thread_join(thread);
+    g_assert(test.async.peer[0] == peers[0]);
+    g_assert(peers[1] == peers[0]);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+    da_peer_unref(test.async.peer[0]);
+    g_mutex_clear(&test.lock);
+    g_cond_clear(&test.cond);
+
+    test_peer_release_name(c);
+    test_peer_reset();
+    g_dbus_connection_close_sync(c, NULL, NULL);
+    g_object_unref(c);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Vanished
+ *==========================================================================*/
+
+static
+void
+test_peer_vanished(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    GDBusConnection* c;
+    TestPeerAsync test;
+    DAPeerStats stats;
+    GVariant* ret;
+    char* name;
+
+    test_peer_reset();
+    test_peer_stats(&stats);
+
+    /*
+     * NameOwnerChanged("", name) announcing the new connection is still
+     * on its way while it's being looked up. It must not make the lookup
+     * stale.
+     */
+    c = test_peer_connect();
+    name = g_strdup(g_dbus_connection_get_unique_name(c));
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_get_async(TEST_BUS, name, NULL, test_peer_async_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert(test.peer[0]);
+    g_assert_cmpstr(test.peer[0]->name, ==, name);
+    da_peer_unref(test.peer[0]);
+
+    /* The reply comes after the signal, which is then dispatched here */
+    ret = g_dbus_connection_call_sync(bus, "org.freedesktop.DBus",
+        "/org/freedesktop/DBus", "org.freedesktop.DBus", "GetId", NULL,
+        NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+    g_assert(ret);
+    g_variant_unref(ret);
+    while (g_main_context_iteration(NULL, FALSE));
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 1);
+    g_assert(da_peer_get(TEST_BUS, name));
+
+    /* NameOwnerChanged(name, "") removes it from the cache */
+    g_dbus_connection_close_sync(c, NULL, NULL);
+    g_object_unref(c);
+    test_peer_wait(test_peer_vanished_cond, &stats.vanished);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 0);
+
+    test_peer_reset();
+    g_free(name);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Expire
+ *==========================================================================*/
+
+static
+void
+test_peer_expire(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    DAPeerStats stats;
+    guint64 expired;
+
+    test_peer_reset();
+    da_peer_set_cache_limits(TEST_BUS, 1, 0);
+    test_peer_stats(&stats);
+    expired = stats.expired;
+
+    /* Expire it explicitly */
+    g_assert(da_peer_get(TEST_BUS, self));
+    g_usleep(G_USEC_PER_SEC + G_USEC_PER_SEC / 10);
+    da_peer_expire(TEST_BUS);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 0);
+    g_assert_cmpuint(stats.expired, ==, expired + 1);
+
+    /* And let the sweep do that */
+    g_assert(da_peer_get(TEST_BUS, self));
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 1);
+    test_peer_wait(test_peer_size_cond, GUINT_TO_POINTER(0));
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.expired, ==, expired + 2);
+
+    test_peer_reset();
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Evict
+ *==========================================================================*/
+
+static
+void
+test_peer_evict(
+    void)
+{
+    GDBusConnection* c[3];
+    DAPeerStats stats;
+    guint64 evicted, queries;
+    guint i;
+
+    test_peer_reset();
+    da_peer_set_cache_limits(TEST_BUS, 30, 2);
+    test_peer_stats(&stats);
+    evicted = stats.evicted;
+    for (i = 0; i < G_N_ELEMENTS(c); i++) {
+        c[i] = test_peer_connect();
+        g_assert(da_peer_get(TEST_BUS, g_dbus_connection_get_unique_name
+            (c[i])));
+    }
+
+    /* The least recently used one is gone */
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 2);
+    g_assert_cmpuint(stats.evicted, ==, evicted + 1);
+    queries = test_peer_queries();
+    g_assert(da_peer_get(TEST_BUS, g_dbus_connection_get_unique_name(c[2])));
+    g_assert_cmpuint(test_peer_queries(), ==, queries);
+    g_assert(da_peer_get(TEST_BUS, g_dbus_connection_get_unique_name(c[0])));
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+
+    /* Shrinking the cache evicts the extra entries right away */
+    da_peer_set_cache_limits(TEST_BUS, 30, 1);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 1);
+    g_assert_cmpuint(stats.evicted, ==, evicted + 3);
+
+    test_peer_reset();
+    for (i = 0; i < G_N_ELEMENTS(c); i++) {
+        g_dbus_connection_close_sync(c[i], NULL, NULL);
+        g_object_unref(c[i]);
+    }
+}
+
+/*==========================================================================*
+ * Threads
+ *==========================================================================*/
+
+#define TEST_THREADS_COUNT (4)
+#define TEST_THREADS_LOOPS (100)
+
+typedef struct test_peer_threads {
+    const char* name[2];
+    gint running;
+} TestPeerThreads;
+
+static
+gpointer
+test_peer_threads_run(
+    gpointer data)
+{
+    TestPeerThreads* test = data;
+    guint i;
+
+    for (i = 0; i < TEST_THREADS_LOOPS; i++) {
+        const char* name = test->name[i % 2];
+        DAPeer* peer = da_peer_get(TEST_BUS, name);
+
+        g_assert(peer);
+        if (!(i % 10)) {
+            /* Stays alive until this thread calls da_peer_get again */
+            da_peer_flush(TEST_BUS, name);
+        }
+        g_assert_cmpstr(peer->name, ==, name);
+        g_assert_cmpint(peer->pid, ==, getpid());
+    }
+    g_atomic_int_add(&test->running, -1);
+    return NULL;
+}
+
+static
+void
+test_peer_threads(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    GDBusConnection* c = test_peer_connect();
+    GThread* thread[TEST_THREADS_COUNT];
+    TestPeerThreads test;
+    DAPeer* peer[2];
+    guint i;
+
+    test_peer_reset();
+    test.name[0] = g_dbus_connection_get_unique_name(bus);
+    test.name[1] = g_dbus_connection_get_unique_name(c);
+
+    /* Evicted peer survives until the bus context gets to run */
+    da_peer_set_cache_limits(TEST_BUS, 30, 1);
+    peer[0] = da_peer_get(TEST_BUS, test.name[0]);
+    g_assert(peer[0]);
+    peer[1] = da_peer_get(TEST_BUS, test.name[1]);
+    g_assert(peer[1]);
+    g_assert(test_peer_size_cond(GUINT_TO_POINTER(1)));
+    g_assert_cmpstr(peer[0]->name, ==, test.name[0]);
+    g_assert_cmpint(peer[0]->pid, ==, getpid());
+    da_peer_set_cache_limits(TEST_BUS, 30, 0);
+
+    /* Lookups and flushes from several threads at once */
+    test.running = TEST_THREADS_COUNT;
+    for (i = 0; i < TEST_THREADS_COUNT; i++) {
+        thread[i] = g_thread_new("test", test_peer_threads_run, &test);
+    }
+    /* This thread runs the bus context */
+    test_peer_wait(test_peer_count_cond, &test.running);
+    for (i = 0; i < TEST_THREADS_COUNT; i++) {
+        g_thread_join(thread[i]);
+    }
+
+    test_peer_reset();
+    g_dbus_connection_close_sync(c, NULL, NULL);
+    g_object_unref(c);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Prefetch
+ *==========================================================================*/
+
+typedef struct test_peer_prefetch {
+    gboolean accept;
+    int calls;
+    int destroyed;
+} TestPeerPrefetch;
+
+static
+gboolean
+test_peer_prefetch_filter(
+    DA_BUS bus,
+    const char* name,
+    const char* owner,
+    gpointer user_data)
+{
+    TestPeerPrefetch* test = user_data;
+    g_assert(bus == TEST_BUS);
+    g_assert(name);
+    g_assert(owner);
+    test->calls++;
+    return test->accept;
+}
+
+static
+void
+test_peer_prefetch_destroy(
+    gpointer user_data)
+{
+    TestPeerPrefetch* test = user_data;
+    test->destroyed++;
+}
+
+static
+gboolean
+test_peer_prefetch_cond(
+    gpointer data)
+{
+    TestPeerPrefetch* test = data;
+    return test->calls > 0;
+}
+
+static
+void
+test_peer_prefetch(
+    void)
+{
+    GDBusConnection* c;
+    TestPeerPrefetch test;
+    guint64 queries;
+    DAPeer* peer;
+    char* name;
+
+    test_peer_reset();
+    memset(&test, 0, sizeof(test));
+    test.accept = TRUE;
+    da_peer_set_prefetch(TEST_BUS, test_peer_prefetch_filter, &test,
+        test_peer_prefetch_destroy);
+
+    /* New connection gets looked up as soon as it shows up */
+    c = test_peer_connect();
+    name = g_strdup(g_dbus_connection_get_unique_name(c));
+    test_peer_wait(test_peer_size_cond, GUINT_TO_POINTER(1));
+    g_assert_cmpint(test.calls, ==, 1);
+    queries = test_peer_queries();
+    peer = da_peer_get(TEST_BUS, name);
+    g_assert(peer);
+    g_assert_cmpint(peer->pid, ==, getpid());
+    g_assert_cmpuint(peer->cred.euid, ==, geteuid());
+    g_assert_cmpuint(test_peer_queries(), ==, queries);
+    g_dbus_connection_close_sync(c, NULL, NULL);
+    g_object_unref(c);
+    test_peer_wait(test_peer_size_cond, GUINT_TO_POINTER(0));
+    g_free(name);
+
+    /* Rejected by the filter */
+    test.accept = FALSE;
+    test.calls = 0;
+    queries = test_peer_queries();
+    c = test_peer_connect();
+    test_peer_wait(test_peer_prefetch_cond, &test);
+    g_assert(test_peer_size_cond(GUINT_TO_POINTER(0)));
+    g_assert_cmpuint(test_peer_queries(), ==, queries);
+
+    /* Disabling prefetch releases the filter */
+    g_assert_cmpint(test.destroyed, ==, 0);
+    da_peer_set_prefetch(TEST_BUS, NULL, NULL, NULL);
+    g_assert_cmpint(test.destroyed, ==, 1);
+
+    test_peer_reset();
+    g_dbus_connection_close_sync(c, NULL, NULL);
+    g_object_unref(c);
+}
+
+/*==========================================================================*
+ * Negative
+ *==========================================================================*/
+
+static
+void
+test_peer_negative(
+    void)
+{
+    static const char* names[] = {
+        TEST_NO_SUCH_NAME "1", TEST_NO_SUCH_NAME "2", TEST_NO_SUCH_NAME "3"
+    };
+    DAPeerStats stats;
+    guint64 queries, rejected;
+    guint i;
+
+    test_peer_reset();
+    da_peer_set_negative_cache_limits(TEST_BUS, 5, 2);
+    queries = test_peer_queries();
+    for (i = 0; i < G_N_ELEMENTS(names); i++) {
+        g_assert(!da_peer_get(TEST_BUS, names[i]));
+    }
+
+    /* Only the two most recent failures are remembered */
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.failed, ==, 2);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 3);
+    g_assert(!da_peer_get(TEST_BUS, names[2]));
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 3);
+    g_assert(!da_peer_get(TEST_BUS, names[0]));
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 4);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.failed, ==, 2);
+
+    /* Flushing the name forgets the failure */
+    da_peer_flush(TEST_BUS, names[0]);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.failed, ==, 1);
+
+    test_peer_reset();
+
+    /* Repeated lookups are rejected without asking */
+    queries = test_peer_queries();
+    test_peer_stats(&stats);
+    g_assert(!da_peer_get(TEST_BUS, names[2]));
+    g_assert(!da_peer_get(TEST_BUS, names[2]));
+    g_assert_cmpuint(test_peer_queries(), ==, queries);
+    rejected = stats.rejected;
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.rejected, ==, rejected + 2);
+
+    /* Disabling negative caching drops the failures */
+    da_peer_set_negative_cache_limits(TEST_BUS, 0, 0);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.failed, ==, 0);
+    g_assert(!da_peer_get(TEST_BUS, names[2]));
+    g_assert(!da_peer_get(TEST_BUS, names[2]));
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 2);
+
+    test_peer_reset();
+}
+
+/*==========================================================================*
+ * Stale
+ *==========================================================================*/
+
+static
+gboolean
+test_peer_queries_cond(
+    gpointer data)
+{
+    return test_peer_queries() >= *(guint64*)data;
+}
+
+static
+void
+test_peer_stale(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    DAPeerStats stats;
+    guint64 queries, refreshes;
+    DAPeer* peer;
+    DAPeer* fresh;
+
+    test_peer_reset();
+    da_peer_set_cache_limits(TEST_BUS, 1, 0);
+    da_peer_set_stale_timeout(TEST_BUS, 30);
+    test_peer_stats(&stats);
+    refreshes = stats.refreshes;
+    peer = da_peer_ref(da_peer_get(TEST_BUS, self));
+    g_assert(peer);
+    queries = test_peer_queries();
+
+    /* Not expired yet */
+    g_assert(da_peer_get(TEST_BUS, self) == peer);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.refreshes, ==, refreshes);
+
+    /* Expired but still served, while it's being refreshed */
+    g_usleep(G_USEC_PER_SEC + G_USEC_PER_SEC / 10);
+    g_assert(da_peer_get(TEST_BUS, self) == peer);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.refreshes, ==, refreshes + 1);
+
+    /* The refresh replaces the entry */
+    queries++;
+    test_peer_wait(test_peer_queries_cond, &queries);
+    fresh = da_peer_get(TEST_BUS, self);
+    g_assert(fresh);
+    g_assert(fresh != peer);
+    g_assert_cmpint(fresh->pid, ==, getpid());
+    g_assert_cmpuint(test_peer_queries(), ==, queries);
+    test_peer_stats(&stats);
+    g_assert_cmpuint(stats.size, ==, 1);
+    g_assert_cmpuint(stats.refreshes, ==, refreshes + 1);
+    da_peer_unref(peer);
+
+    test_peer_reset();
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Check
+ *==========================================================================*/
+
+static
+void
+test_peer_check(
+    void)
+{
+    static const DA_ACTION actions[] = {
+        { "foo", 1, 1 },
+        { NULL }
+    };
+    GDBusConnection* bus = test_peer_bus();
+    DAPolicy* p1 = da_policy_new_full(V ";foo(a)=allow", actions);
+    DAPolicy* p2 = da_policy_new_full(V ";foo(a)=deny", actions);
+    DAPeer* peer;
+    guint i;
+
+    test_peer_reset();
+    g_assert(p1);
+    g_assert(p2);
+    peer = da_peer_ref(da_peer_get(TEST_BUS,
+        g_dbus_connection_get_unique_name(bus)));
+    g_assert(peer);
+
+    /* Remembered results must match the policy, and each other */
+    for (i = 0; i < 2; i++) {
+        g_assert(da_peer_check(peer, p1, 1, "a", DA_ACCESS_DENY) ==
+            da_policy_check(p1, &peer->cred, 1, "a", DA_ACCESS_DENY));
+        g_assert(da_peer_check(peer, p1, 1, "b", DA_ACCESS_DENY) ==
+            da_policy_check(p1, &peer->cred, 1, "b", DA_ACCESS_DENY));
+        g_assert(da_peer_check(peer, p1, 1, "b", DA_ACCESS_ALLOW) ==
+            da_policy_check(p1, &peer->cred, 1, "b", DA_ACCESS_ALLOW));
+        g_assert(da_peer_check(peer, p2, 1, "a", DA_ACCESS_ALLOW) ==
+            da_policy_check(p2, &peer->cred, 1, "a", DA_ACCESS_ALLOW));
+        g_assert(da_peer_check(peer, p1, 1, NULL, DA_ACCESS_DENY) ==
+            da_policy_check(p1, &peer->cred, 1, NULL, DA_ACCESS_DENY));
+    }
+
+    /* More results than the peer remembers */
+    for (i = 0; i < 100; i++) {
+        char* arg = g_strdup_printf("%u", i % 50);
+        g_assert(da_peer_check(peer, p1, 1, arg, DA_ACCESS_DENY) ==
+            da_policy_check(p1, &peer->cred, 1, arg, DA_ACCESS_DENY));
+        g_free(arg);
+    }
+
+    /* Still correct after the peer has left the cache */
+    da_peer_flush(TEST_BUS, NULL);
+    g_assert(da_peer_check(peer, p1, 1, "a", DA_ACCESS_DENY) ==
+        da_policy_check(p1, &peer->cred, 1, "a", DA_ACCESS_DENY));
+
+    /* NULL arguments are handled by da_policy_check */
+    g_assert(da_peer_check(NULL, p1, 1, "a", DA_ACCESS_DENY) ==
+        da_policy_check(p1, NULL, 1, "a", DA_ACCESS_DENY));
+    g_assert(da_peer_check(peer, NULL, 1, "a", DA_ACCESS_DENY) ==
+        da_policy_check(NULL, &peer->cred, 1, "a", DA_ACCESS_DENY));
+
+    da_peer_unref(peer);
+    da_policy_unref(p1);
+    da_policy_unref(p2);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Authorize
+ *==========================================================================*/
+
+typedef struct test_peer_authorize {
+    DAPolicy* policy;
+    int pending;
+    int authorized;
+    int denied;
+    int destroyed;
+} TestPeerAuthorize;
+
+static
+void
+test_peer_authorized(
+    GDBusMethodInvocation* invocation,
+    DAPeer* peer,
+    gpointer user_data)
+{
+    TestPeerAuthorize* test = user_data;
+    g_assert(peer);
+    g_assert_cmpstr(peer->name, ==,
+        g_dbus_method_invocation_get_sender(invocation));
+    test->authorized++;
+    g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static
+void
+test_peer_authorize_destroy(
+    gpointer user_data)
+{
+    TestPeerAuthorize* test = user_data;
+    test->destroyed++;
+}
+
+static
+void
+test_peer_method_call(
+    GDBusConnection* connection,
+    const char* sender,
+    const char* path,
+    const char* iface,
+    const char* method,
+    GVariant* args,
+    GDBusMethodInvocation* invocation,
+    gpointer user_data)
+{
+    TestPeerAuthorize* test = user_data;
+    da_peer_authorize(invocation, test->policy, 1, NULL, DA_ACCESS_DENY,
+        test_peer_authorized, test, test_peer_authorize_destroy);
+}
+
+static
+void
+test_peer_call_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    TestPeerAuthorize* test = user_data;
+    GError* error = NULL;
+    GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(object),
+        result, &error);
+    if (ret) {
+        g_variant_unref(ret);
+    } else {
+        g_assert(g_error_matches(error, G_DBUS_ERROR,
+            G_DBUS_ERROR_ACCESS_DENIED));
+        g_error_free(error);
+        test->denied++;
+    }
+    test->pending--;
+}
+
+static
+void
+test_peer_call(
+    TestPeerAuthorize* test,
+    GDBusConnection* client,
+    const char* service)
+{
+    test->pending = 1;
+    g_dbus_connection_call(client, service, TEST_PATH, TEST_IFACE,
+        TEST_METHOD, NULL, NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+        test_peer_call_done, test);
+    test_peer_wait(test_peer_count_cond, &test->pending);
+}
+
+static
+guint
+test_peer_register(
+    GDBusConnection* connection,
+    TestPeerAuthorize* test)
+{
+    static const GDBusInterfaceVTable vtable = {
+        test_peer_method_call, NULL, NULL
+    };
+    GDBusNodeInfo* info = g_dbus_node_info_new_for_xml("<node>"
+        "<interface name='" TEST_IFACE "'>"
+        "<method name='" TEST_METHOD "'/>"
+        "</interface></node>", NULL);
+    guint id;
+
+    g_assert(info);
+    id = g_dbus_connection_register_object(connection, TEST_PATH,
+        info->interfaces[0], &vtable, test, NULL, NULL);
+    g_assert(id);
+    g_dbus_node_info_unref(info);
+    return id;
+}
+
+static
+void
+test_peer_authorize(
+    void)
+{
+    static const DA_ACTION actions[] = {
+        { "foo", 1, 0 },
+        { NULL }
+    };
+    GDBusConnection* bus = test_peer_bus();
+    GDBusConnection* client = test_peer_connect();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    DAPolicy* allow = da_policy_new_full(V ";foo()=allow", actions);
+    DAPolicy* deny = da_policy_new_full(V ";foo()=deny", actions);
+    TestPeerAuthorize test;
+    const DACred* cred;
+    DA_ACCESS allowed, denied;
+    guint64 queries;
+    guint id;
+
+    test_peer_reset();
+    g_assert(allow);
+    g_assert(deny);
+    memset(&test, 0, sizeof(test));
+    id = test_peer_register(bus, &test);
+
+    /* The client is this process, just on another connection */
+    cred = &da_peer_get(TEST_BUS, self)->cred;
+    allowed = da_policy_check(allow, cred, 1, NULL, DA_ACCESS_DENY);
+    denied = da_policy_check(deny, cred, 1, NULL, DA_ACCESS_DENY);
+    queries = test_peer_queries();
+
+    /* The sender is looked up on the connection the call came from */
+    test.policy = allow;
+    test_peer_call(&test, client, self);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+    if (allowed == DA_ACCESS_ALLOW) {
+        g_assert_cmpint(test.authorized, ==, 1);
+    } else {
+        g_assert_cmpint(test.denied, ==, 1);
+    }
+    g_assert_cmpint(test.destroyed, ==, 1);
+
+    /* The sender is cached now */
+    test.authorized = test.denied = 0;
+    test.policy = deny;
+    test_peer_call(&test, client, self);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+    if (denied == DA_ACCESS_ALLOW) {
+        /* Root gets through anyway */
+        g_assert_cmpint(test.authorized, ==, 1);
+    } else {
+        g_assert_cmpint(test.denied, ==, 1);
+    }
+    g_assert_cmpint(test.destroyed, ==, 2);
+
+    g_dbus_connection_unregister_object(bus, id);
+    da_policy_unref(allow);
+    da_policy_unref(deny);
+    test_peer_reset();
+    g_dbus_connection_close_sync(client, NULL, NULL);
+    g_object_unref(client);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Filter
+ *==========================================================================*/
+
+static
+void
+test_peer_filter(
+    void)
+{
+    static const DA_ACTION actions[] = {
+        { "foo", 1, 0 },
+        { NULL }
+    };
+    GDBusConnection* bus = test_peer_bus();
+    GDBusConnection* client = test_peer_connect();
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    DAPolicy* policy = da_policy_new_full(V ";foo()=allow", actions);
+    TestPeerAuthorize test;
+    guint64 queries;
+    guint id, filter;
+
+    test_peer_reset();
+    g_assert(policy);
+    memset(&test, 0, sizeof(test));
+    test.policy = policy;
+    id = test_peer_register(bus, &test);
+    g_assert(!da_peer_install_filter(TEST_BUS, NULL));
+    filter = da_peer_install_filter(TEST_BUS, bus);
+    g_assert(filter);
+    queries = test_peer_queries();
+
+    /* The filter and da_peer_authorize share the lookup */
+    test_peer_call(&test, client, self);
+    g_assert_cmpint(test.authorized + test.denied, ==, 1);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+    g_assert(test_peer_size_cond(GUINT_TO_POINTER(1)));
+
+    /* Known senders aren't looked up again */
+    test_peer_call(&test, client, self);
+    g_assert_cmpint(test.authorized + test.denied, ==, 2);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 1);
+
+    /* Without the filter, da_peer_authorize does the lookup itself */
+    da_peer_remove_filter(bus, filter);
+    da_peer_remove_filter(bus, 0);
+    da_peer_flush(TEST_BUS, NULL);
+    test_peer_call(&test, client, self);
+    g_assert_cmpint(test.authorized + test.denied, ==, 3);
+    g_assert_cmpuint(test_peer_queries(), ==, queries + 2);
+
+    g_dbus_connection_unregister_object(bus, id);
+    da_policy_unref(policy);
+    test_peer_reset();
+    g_dbus_connection_close_sync(client, NULL, NULL);
+    g_object_unref(client);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Init
+ *==========================================================================*/
+
+typedef struct test_peer_init {
+    int pending;
+    int ok;
+    int invalid;
+    int cancelled;
+} TestPeerInit;
+
+static
+void
+test_peer_init_done(
+    GObject* object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    TestPeerInit* test = user_data;
+    GError* error = NULL;
+    g_assert(!object);
+    if (da_peer_bus_init_finish(result, &error)) {
+        g_assert(!error);
+        test->ok++;
+    } else {
+        g_assert(error);
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT)) {
+            test->invalid++;
+        } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            test->cancelled++;
+        }
+        g_error_free(error);
+    }
+    test->pending--;
+}
+
+static
+void
+test_peer_init(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    GDBusConnection* c = test_peer_connect();
+    GCancellable* cancel = g_cancellable_new();
+    TestPeerInit test;
+
+    /* Already connected by the tests above */
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_bus_init_async(TEST_BUS, NULL, test_peer_init_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert_cmpint(test.ok, ==, 1);
+
+    /* Invalid bus type */
+    memset(&test, 0, sizeof(test));
+    test.pending = 1;
+    da_peer_bus_init_async((DA_BUS)42, NULL, test_peer_init_done, &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert_cmpint(test.invalid, ==, 1);
+
+    /*
+     * The system bus may or may not be there, either way the result
+     * arrives without blocking. Cancellation is reported as such.
+     */
+    memset(&test, 0, sizeof(test));
+    test.pending = 2;
+    da_peer_bus_init_async(DA_BUS_SYSTEM, NULL, test_peer_init_done, &test);
+    g_cancellable_cancel(cancel);
+    da_peer_bus_init_async(DA_BUS_SYSTEM, cancel, test_peer_init_done,
+        &test);
+    test_peer_wait(test_peer_count_cond, &test.pending);
+    g_assert_cmpint(test.cancelled, ==, 1);
+    g_assert_cmpint(test.ok, <=, 1);
+
+    /* Only the connection in use can be set again */
+    g_assert(da_peer_bus_set_connection(TEST_BUS, bus));
+    g_assert(!da_peer_bus_set_connection(TEST_BUS, c));
+    g_assert(!da_peer_bus_set_connection(TEST_BUS, NULL));
+    g_assert(!da_peer_bus_set_connection((DA_BUS)42, bus));
+
+    g_object_unref(cancel);
+    g_dbus_connection_close_sync(c, NULL, NULL);
+    g_object_unref(c);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Connection
+ *==========================================================================*/
+
+static
+gboolean
+test_peer_new_connection(
+    GDBusServer* server,
+    GDBusConnection* connection,
+    gpointer user_data)
+{
+    GDBusConnection** server_side = user_data;
+    *server_side = g_object_ref(connection);
+    return TRUE;
+}
+
+static
+gboolean
+test_peer_server_cond(
+    gpointer data)
+{
+    return *(GDBusConnection**)data != NULL;
+}
+
+static
+void
+test_peer_connection(
+    void)
+{
+    GDBusConnection* bus = test_peer_bus();
+    GDBusConnection* c = test_peer_connect();
+    GDBusConnection* server_side = NULL;
+    const char* self = g_dbus_connection_get_unique_name(bus);
+    char* guid = g_dbus_generate_guid();
+    GDBusServer* server;
+    GDBusConnection* p2p;
+    DAPeer* peer;
+
+    test_peer_reset();
+    g_assert(!da_peer_get_for_connection(NULL, self));
+
+    /*
+     * Another connection to the same bus daemon shares the cache with
+     * the connection used by the library.
+     */
+    peer = da_peer_get_for_connection(c, self);
+    g_assert(peer);
+    g_assert(peer == da_peer_get(TEST_BUS, self));
+    g_assert(peer == da_peer_get_for_connection(bus, self));
+    g_assert(!da_peer_get_for_connection(c, NULL));
+
+    /* Peer-to-peer connection, the name is ignored */
+    server = g_dbus_server_new_sync("unix:tmpdir=/tmp",
+        G_DBUS_SERVER_FLAGS_NONE, guid, NULL, NULL, NULL);
+    g_assert(server);
+    g_signal_connect(server, "new-connection",
+        G_CALLBACK(test_peer_new_connection), &server_side);
+    g_dbus_server_start(server);
+    p2p = g_dbus_connection_new_for_address_sync
+        (g_dbus_server_get_client_address(server),
+        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT, NULL, NULL, NULL);
+    g_assert(p2p);
+    peer = da_peer_get_for_connection(p2p, self);
+    g_assert(peer);
+    g_assert(!peer->name);
+    g_assert_cmpint(peer->pid, ==, getpid());
+    g_assert_cmpuint(peer->cred.euid, ==, geteuid());
+
+    /* Cached for the lifetime of the connection */
+    g_assert(da_peer_get_for_connection(p2p, NULL) == peer);
+    da_peer_get_for_connection(NULL, NULL);
+
+    test_peer_wait(test_peer_server_cond, &server_side);
+    g_dbus_connection_close_sync(p2p, NULL, NULL);
+    g_object_unref(p2p);
+    g_dbus_connection_close_sync(server_side, NULL, NULL);
+    g_object_unref(server_side);
+    g_dbus_server_stop(server);
+    g_object_unref(server);
+    g_free(guid);
+    g_dbus_connection_close_sync(c, NULL, NULL);
+    g_object_unref(c);
+    g_object_unref(bus);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_PREFIX "/peer/"
+
+int main(int argc, char* argv[])
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_PREFIX "async", test_peer_async);
+    g_test_add_func(TEST_PREFIX "basic", test_peer_basic);
+    g_test_add_func(TEST_PREFIX "coalesce", test_peer_coalesce);
+    g_test_add_func(TEST_PREFIX "cred", test_peer_cred);
+    g_test_add_func(TEST_PREFIX "proc", test_peer_proc);
+    g_test_add_func(TEST_PREFIX "alias", test_peer_alias);
+    g_test_add_func(TEST_PREFIX "many", test_peer_many);
+    g_test_add_func(TEST_PREFIX "vanished", test_peer_vanished);
+    g_test_add_func(TEST_PREFIX "expire", test_peer_expire);
+    g_test_add_func(TEST_PREFIX "evict", test_peer_evict);
+    g_test_add_func(TEST_PREFIX "threads", test_peer_threads);
+    g_test_add_func(TEST_PREFIX "prefetch", test_peer_prefetch);
+    g_test_add_func(TEST_PREFIX "negative", test_peer_negative);
+    g_test_add_func(TEST_PREFIX "stale", test_peer_stale);
+    g_test_add_func(TEST_PREFIX "check", test_peer_check);
+    g_test_add_func(TEST_PREFIX "authorize", test_peer_authorize);
+    g_test_add_func(TEST_PREFIX "filter", test_peer_filter);
+    g_test_add_func(TEST_PREFIX "init", test_peer_init);
+    g_test_add_func(TEST_PREFIX "connection", test_peer_connection);
+    /* This one makes the main thread own the da_peer_fd context */
+    g_test_add_func(TEST_PREFIX "loop", test_peer_loop);
+    test_init(&test_opt, argc, argv);
+
+    /* Private session bus. The library keeps its connection forever */
+    test_dbus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(test_dbus);
+    ret = g_test_run();
+    g_test_dbus_stop(test_dbus);
+    g_object_unref(test_dbus);
+    return ret;
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -35,6 +35,9 @@
 #include "dbusaccess_parser_p.h"
 #include "dbusaccess_policy.h"
 
+#include <glib/gstdio.h>
+#include <unistd.h>
+
 static TestOpt test_opt;
 
 #define V DA_POLICY_VERSION
@@ -749,6 +752,253 @@ test_policy_check11(
      da_policy_unref(policy);
 }
 
+/*==========================================================================*
+ * Lazy
+ *==========================================================================*/
+
+static
+void
+test_policy_lazy(
+    void)
+{
+    DA_ACTION foo [] = {
+        { "foo", 1, 1 },
+        { NULL }
+    };
+    const char* spec = V ";user(1) & !foo(a)=deny";
+    static const DACred user1 = { 1, 1, NULL, 0, 0, 0 };
+    static const DACred user2 = { 2, 2, NULL, 0, 0, 0 };
+    DAPolicy* policy = da_policy_new_full(spec, foo);
+    DAPolicy* lazy = da_policy_new_lazy(spec, foo);
+
+    g_assert(!da_policy_new_lazy(NULL, NULL));
+    g_assert(policy);
+    g_assert(lazy);
+
+    /* The actions are copied, the caller's array may go away */
+    foo[0].name = "bar";
+    g_assert(da_policy_check(lazy, &user1, 1, "a", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_ALLOW);
+    g_assert(da_policy_check(lazy, &user1, 1, "b", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_DENY);
+    g_assert(da_policy_check(lazy, &user2, 1, "a", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_ALLOW);
+    g_assert(da_policy_equal(policy, lazy));
+    da_policy_unref(lazy);
+
+    /* Compiled (unsuccessfully, without actions) by da_policy_equal */
+    lazy = da_policy_new_lazy(spec, NULL);
+    g_assert(!da_policy_equal(policy, lazy));
+    da_policy_unref(lazy);
+    da_policy_unref(policy);
+
+    /* Never compiled */
+    da_policy_unref(da_policy_new_lazy(spec, foo));
+
+    /* Broken policy is empty, default access applies */
+    lazy = da_policy_new_lazy(V ";bar()", foo);
+    policy = da_policy_new(V);
+    g_assert(lazy);
+    g_assert(da_policy_check(lazy, &user1, 1, NULL, DA_ACCESS_ALLOW) ==
+        DA_ACCESS_ALLOW);
+    g_assert(da_policy_check(lazy, &user1, 1, NULL, DA_ACCESS_DENY) ==
+        DA_ACCESS_DENY);
+    g_assert(da_policy_equal(policy, lazy));
+    da_policy_unref(lazy);
+    da_policy_unref(policy);
+}
+
+/*==========================================================================*
+ * Stream
+ *==========================================================================*/
+
+static
+void
+test_policy_stream(
+    void)
+{
+    static const DA_ACTION foo [] = {
+        { "foo", 1, 1 },
+        { NULL }
+    };
+    static const DACred user1 = { 1, 1, NULL, 0, 0, 0 };
+    static const DACred user2 = { 2, 2, NULL, 0, 0, 0 };
+    char* dir = g_dir_make_tmp("test_policy_XXXXXX", NULL);
+    char* file = g_build_filename(dir, "policy", NULL);
+    GString* buf = g_string_new(V);
+    DAPolicy* policy;
+    DAPolicy* policy2;
+    int i;
+
+    g_assert(!da_policy_new_from_fd(-1, foo));
+    g_assert(!da_policy_new_from_file(NULL, foo));
+    g_assert(!da_policy_new_from_file(file, foo));
+
+    /* Make it large enough to require more than one read */
+    for (i = 0; i < 2000; i++) {
+        g_string_append_printf(buf, ";foo(\"a%d\")=deny", i);
+    }
+    g_string_append(buf, ";user(2)=deny\n");
+    g_assert(g_file_set_contents(file, buf->str, buf->len, NULL));
+    policy = da_policy_new_from_file(file, foo);
+    policy2 = da_policy_new_full(buf->str, foo);
+    g_assert(policy);
+    g_assert(policy2);
+    g_assert(da_policy_equal(policy, policy2));
+    g_assert(da_policy_check(policy, &user1, 1, "a1999", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_DENY);
+    g_assert(da_policy_check(policy, &user1, 1, "a2000", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_ALLOW);
+    g_assert(da_policy_check(policy, &user2, 1, "a2000", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_DENY);
+    da_policy_unref(policy);
+    da_policy_unref(policy2);
+
+    /* Broken entry at the very end */
+    g_string_append(buf, ";bar()");
+    g_assert(g_file_set_contents(file, buf->str, buf->len, NULL));
+    g_assert(!da_policy_new_from_file(file, foo));
+
+    /* Quoted string spanning the chunk boundary */
+    g_string_assign(buf, V ";foo(\"");
+    for (i = 0; i < 20000; i++) {
+        g_string_append_c(buf, 'x');
+    }
+    g_string_append(buf, "\")=deny");
+    g_assert(g_file_set_contents(file, buf->str, buf->len, NULL));
+    policy = da_policy_new_from_file(file, foo);
+    policy2 = da_policy_new_full(buf->str, foo);
+    g_assert(policy);
+    g_assert(da_policy_equal(policy, policy2));
+    da_policy_unref(policy);
+    da_policy_unref(policy2);
+
+    g_string_free(buf, TRUE);
+    g_remove(file);
+    g_rmdir(dir);
+    g_free(file);
+    g_free(dir);
+}
+
+/*==========================================================================*
+ * Pipe
+ *==========================================================================*/
+
+static
+void
+test_policy_pipe(
+    void)
+{
+    static const char spec[] = V ";group(1)=deny";
+    static const DACred user1 = { 1, 1, NULL, 0, 0, 0 };
+    DAPolicy* policy;
+    DAPolicy* policy2;
+    int fd[2];
+
+    g_assert(!pipe(fd));
+    g_assert(write(fd[1], spec, sizeof(spec) - 1) == sizeof(spec) - 1);
+    close(fd[1]);
+    policy = da_policy_new_from_fd(fd[0], NULL);
+    policy2 = da_policy_new(spec);
+    close(fd[0]);
+    g_assert(policy);
+    g_assert(da_policy_equal(policy, policy2));
+    g_assert(da_policy_check(policy, &user1, 0, NULL, DA_ACCESS_ALLOW) ==
+        DA_ACCESS_DENY);
+    da_policy_unref(policy);
+    da_policy_unref(policy2);
+}
+
+/*==========================================================================*
+ * Update
+ *==========================================================================*/
+
+static
+void
+test_policy_update(
+    void)
+{
+    static const DA_ACTION foo [] = {
+        { "foo", 1, 1 },
+        { NULL }
+    };
+    static const DACred user1 = { 1, 1, NULL, 0, 0, 0 };
+    static const DACred user2 = { 2, 2, NULL, 0, 0, 0 };
+    DAPolicy* policy = da_policy_new_full(V ";user(1)=deny;user(2)=deny",
+        foo);
+    DAPolicy* policy2;
+    DAPolicy* policy3;
+
+    g_assert(policy);
+    g_assert(da_policy_count(policy) == 2);
+    g_assert(!da_policy_count(NULL));
+    g_assert(!da_policy_insert(NULL, 0, "*=deny", NULL));
+    g_assert(!da_policy_insert(policy, 0, NULL, NULL));
+    g_assert(!da_policy_insert(policy, 3, "*=deny", NULL));
+    g_assert(!da_policy_insert(policy, 0, "bar()", foo));
+    g_assert(!da_policy_remove(NULL, 0, 0));
+    g_assert(!da_policy_remove(policy, 1, 2));
+    g_assert(!da_policy_remove(policy, 3, 0));
+    g_assert(!da_policy_replace(policy, 0, 1, NULL, NULL));
+    g_assert(!da_policy_replace(policy, 2, 1, "*=deny", NULL));
+
+    /* Append (the version is optional) */
+    policy2 = da_policy_insert(policy, 2, V ";foo(a)=allow", foo);
+    policy3 = da_policy_new_full(V ";user(1)=deny;user(2)=deny;foo(a)", foo);
+    g_assert(policy2);
+    g_assert(da_policy_count(policy2) == 3);
+    g_assert(da_policy_equal(policy2, policy3));
+    g_assert(da_policy_check(policy2, &user1, 1, "a", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_ALLOW);
+    g_assert(da_policy_check(policy2, &user1, 1, "b", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_DENY);
+    da_policy_unref(policy3);
+
+    /* The original policy is unaffected */
+    g_assert(da_policy_count(policy) == 2);
+    g_assert(da_policy_check(policy, &user1, 1, "a", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_DENY);
+
+    /* Remove */
+    policy3 = da_policy_remove(policy2, 0, 1);
+    da_policy_unref(policy2);
+    policy2 = da_policy_new_full("user(2)=deny;foo(a)", foo);
+    g_assert(policy3);
+    g_assert(da_policy_equal(policy2, policy3));
+    g_assert(da_policy_check(policy3, &user1, 1, "b", DA_ACCESS_ALLOW) ==
+        DA_ACCESS_ALLOW);
+    da_policy_unref(policy2);
+
+    /* Removing nothing produces an equal policy */
+    policy2 = da_policy_remove(policy3, 2, 0);
+    g_assert(policy2);
+    g_assert(da_policy_equal(policy2, policy3));
+    da_policy_unref(policy2);
+    da_policy_unref(policy3);
+
+    /* Replace */
+    policy2 = da_policy_replace(policy, 1, 1, "user(2)=allow;group(1)", foo);
+    policy3 = da_policy_new("user(1)=deny;user(2)=allow;group(1)");
+    g_assert(policy2);
+    g_assert(da_policy_count(policy2) == 3);
+    g_assert(da_policy_equal(policy2, policy3));
+    g_assert(da_policy_check(policy2, &user2, 0, NULL, DA_ACCESS_DENY) ==
+        DA_ACCESS_ALLOW);
+    g_assert(da_policy_check(policy2, &user1, 0, NULL, DA_ACCESS_DENY) ==
+        DA_ACCESS_ALLOW);
+    da_policy_unref(policy2);
+    da_policy_unref(policy3);
+
+    /* Lazy policy gets compiled before it's modified */
+    policy2 = da_policy_new_lazy(V ";user(1)=deny;user(2)=deny", foo);
+    policy3 = da_policy_remove(policy2, 0, 0);
+    g_assert(da_policy_equal(policy, policy3));
+    da_policy_unref(policy2);
+    da_policy_unref(policy3);
+
+    da_policy_unref(policy);
+}
+
 /*==========================================================================*
  * Common
  *==========================================================================*/
@@ -785,6 +1035,10 @@ int main(int argc, char* argv[])
     g_test_add_func(TEST_PREFIX "check9", test_policy_check9);
     g_test_add_func(TEST_PREFIX "check10", test_policy_check10);
     g_test_add_func(TEST_PREFIX "check11", test_policy_check11);
+    g_test_add_func(TEST_PREFIX "lazy", test_policy_lazy);
+    g_test_add_func(TEST_PREFIX "stream", test_policy_stream);
+    g_test_add_func(TEST_PREFIX "pipe", test_policy_pipe);
+    g_test_add_func(TEST_PREFIX "update", test_policy_update);
     test_init(&test_opt, argc, argv);
     return g_test_run();
 }
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2026 Jolla Ltd.
+ * Copyright (C) 2026 Slava Monich <slava.monich@jolla.com>
+ *
+ * You may use this file under the terms of BSD license as follows:
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *   3. Neither the names of the copyright holders nor the names of its
+ *      contributors may be used to endorse or promote products derived
+ *      from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+ * THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test_common.h"
+
+#include "dbusaccess_policy_slot.h"
+
+static TestOpt test_opt;
+
+#define V DA_POLICY_VERSION
+
+static const DACred test_user = { 1, 1, NULL, 0, 0, 0 };
+
+/*==========================================================================*
+ * Null
+ *==========================================================================*/
+
+static
+void
+test_slot_null(
+    void)
+{
+    DAPolicySlot* slot = da_policy_slot_new(NULL);
+
+    g_assert(!da_policy_slot_ref(NULL));
+    g_assert(!da_policy_slot_get(NULL));
+    da_policy_slot_unref(NULL);
+    da_policy_slot_set(NULL, NULL);
+    g_assert(da_policy_slot_check(NULL, &test_user, 0, NULL,
+        DA_ACCESS_ALLOW) == DA_ACCESS_ALLOW);
+    g_assert(da_policy_slot_check(NULL, &test_user, 0, NULL,
+        DA_ACCESS_DENY) == DA_ACCESS_DENY);
+
+    /* Empty slot */
+    g_assert(slot);
+    g_assert(!da_policy_slot_get(slot));
+    g_assert(da_policy_slot_check(slot, &test_user, 0, NULL,
+        DA_ACCESS_DENY) == DA_ACCESS_DENY);
+    da_policy_slot_set(slot, NULL);
+    da_policy_slot_unref(slot);
+}
+
+/*==========================================================================*
+ * Basic
+ *==========================================================================*/
+
+static
+void
+test_slot_basic(
+    void)
+{
+    DAPolicy* allow = da_policy_new(V ";*=allow");
+    DAPolicy* deny = da_policy_new(V ";*=deny");
+    DAPolicySlot* slot = da_policy_slot_new(allow);
+    DAPolicy* policy;
+
+    g_assert(da_policy_slot_ref(slot) == slot);
+    da_policy_slot_unref(slot);
+
+    policy = da_policy_slot_get(slot);
+    g_assert(policy == allow);
+    da_policy_unref(policy);
+    g_assert(da_policy_slot_check(slot, &test_user, 0, NULL,
+        DA_ACCESS_DENY) == DA_ACCESS_ALLOW);
+
+    /* Setting the same policy is a noop */
+    da_policy_slot_set(slot, allow);
+    da_policy_slot_set(slot, deny);
+    g_assert(da_policy_slot_check(slot, &test_user, 0, NULL,
+        DA_ACCESS_ALLOW) == DA_ACCESS_DENY);
+
+    /* The slot holds its own references */
+    da_policy_unref(allow);
+    da_policy_unref(deny);
+    da_policy_slot_unref(slot);
+}
+
+/*==========================================================================*
+ * Threads
+ *==========================================================================*/
+
+#define TEST_THREADS (4)
+#define TEST_UPDATES (1000)
+
+typedef struct test_slot_threads {
+    DAPolicySlot* slot;
+    gint done;
+} TestSlotThreads;
+
+static
+gpointer
+test_slot_reader(
+    gpointer data)
+{
+    TestSlotThreads* test = data;
+    guint n = 0;
+    while (!g_atomic_int_get(&test->done) || !n) {
+        DAPolicy* policy = da_policy_slot_get(test->slot);
+        /* Both policies produce the same result */
+        g_assert(policy);
+        g_assert(da_policy_check(policy, &test_user, 0, NULL,
+            DA_ACCESS_ALLOW) == DA_ACCESS_DENY);
+        da_policy_unref(policy);
+        g_assert(da_policy_slot_check(test->slot, &test_user, 0, NULL,
+            DA_ACCESS_ALLOW) == DA_ACCESS_DENY);
+        n++;
+    }
+    return NULL;
+}
+
+static
+void
+test_slot_threads(
+    void)
+{
+    DAPolicy* p1 = da_policy_new(V ";*=deny");
+    GThread* threads[TEST_THREADS];
+    TestSlotThreads test;
+    int i;
+
+    memset(&test, 0, sizeof(test));
+    test.slot = da_policy_slot_new(p1);
+    da_policy_unref(p1);
+    for (i = 0; i < TEST_THREADS; i++) {
+        threads[i] = g_thread_new("reader", test_slot_reader, &test);
+    }
+
+    /* Each policy gets freed as soon as it's replaced */
+    for (i = 0; i < TEST_UPDATES; i++) {
+        DAPolicy* policy = da_policy_new(V ";user(1)=deny");
+        da_policy_slot_set(test.slot, policy);
+        da_policy_unref(policy);
+    }
+
+    g_atomic_int_set(&test.done, TRUE);
+    for (i = 0; i < TEST_THREADS; i++) {
+        g_thread_join(threads[i]);
+    }
+    da_policy_slot_unref(test.slot);
+}
+
+/*==========================================================================*
+ * Common
+ *==========================================================================*/
+
+#define TEST_PREFIX "/slot/"
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func(TEST_PREFIX "null", test_slot_null);
+    g_test_add_func(TEST_PREFIX "basic", test_slot_basic);
+    g_test_add_func(TEST_PREFIX "threads", test_slot_threads);
+    test_init(&test_opt, argc, argv);
+    return g_test_run();
+}
+
+/*
+ * Local Variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */